@@ -1,82 +1,123 @@
-%function ANF(name)
+function ANClick(infile,chans,outdir,L,prec,compress,spikes,seed)
+%ANClick(infile,chans,outdir,L,prec,compress,spikes,seed) runs the IHC and AN stages for the
+%stimulus channels chans of a cochlea output file and saves the TH_IHC_,
+%TH_ANLS_, TH_ANMS_ and TH_ANHS_ files in outdir, L holds the level of every
+%channel. prec ('double' or 'single') is the precision the files are saved
+%in, the stages always run in double (Velocity can be single, see StorageType
+%in run_cochlear_model.py). compress=false saves the files uncompressed, faster
+%to write and larger (default true). spikes=true also saves the spike trains
+%of the three fibers of every CF in TH_SPK_<L>.mat (see SaveSpikes, LoadSpikes
+%and SpikePSTH). With seed, the random number generator is set to rng(seed)
+%before every level, so runs with the same seed draw the same ffGn noise and
+%spikes (compare runs with PrecisionReport), default [] leaves it unseeded.
+%The files of a level are written on a background thread while the next
+%level is computed (see AsyncWrite), they are all written when ANClick returns.
+%The per-CF seconds of the IHC stage, the Synapse and the SpikeGenerator of
+%every level go to the sidecar TH_AN_<L>.stats.json (see SaveStats).
+%Without arguments it runs channel 9 of ../out/Clicks/output.mat.
 close all
-clear all
+here=fileparts(mfilename('fullpath'));
+addpath(fullfile(here,'..','sysfiles')) %StageKey, StageCache, SaveStats, AsyncWrite
 
-L=0:10:100;
-%name='NHClicksME';
-name='output';
+if nargin<1
+    %name='NHClicksME';
+    name='output';
+    infile=['../out/Clicks/',name,'.mat'];
+end
+if nargin<2
+    chans=9;
+end
+if nargin<3
+    outdir='/home/gmehraei/ABRFFRmodel/out/Clicks/';
+end
+if nargin<4
+    L=0:10:100;
+end
+if nargin<5
+    prec='double';
+end
+if nargin<6
+    compress=true;
+end
+if nargin<7
+    spikes=false;
+end
+if nargin<8
+    seed=[];
+end
 
 FS=100000;
 implnt=0;
 n=1;
 
 tic
-load(['../out/Clicks/',name,'.mat'],'Velocity','Fc');
+load(infile,'Velocity','Fc');
+%the key of the cochlea stage stands for Velocity, if it was saved with one
+upkey='';
+if ismember('CacheKey',who('-file',infile))
+    upkey=load(infile,'CacheKey');
+    upkey=upkey.CacheKey;
+end
+%the AN stage depends on this script, the IHC stage and the AN model
+src={fileread([mfilename('fullpath'),'.m']),fileread(fullfile(here,'IHCStage.m')),fileread(fullfile(here,'Verhulst2014_NOFD_TH.c')),fileread(fullfile(here,'fastmath.h'))};
 CF=Fc(2:2:numel(Fc));
 %% parameters
 nrep=1; %number of stimulus repetitions
-Mvel=41e-6; %from 1 kHz max BM vel from Heinz Stimuli 100dB.. %0.09645;, where the fuck does this high value come from.. %Max BM velocity in the model
-Mu=200e-9;  %Max cilia displacement in the model
-Fcut=513;   %this value should come somewhere from Sellick et al.
-tau_c=1/(2*pi*Fcut);
-Fgain=Mu/Mvel;
-
-%for the IHC low-pass filter a la Zilany et al., with different
-%cut-off here 2.5 iso 3800/3000kHz in Zilany!
-F_LPC=1000; % 2500; %4500;     %4500 in Heinz model! %3800/3000 in zilani in original  %IHC lowpass cutoff frequency, Heinz uses 4500Hz
-LPk=2 ; %7;         %order of the lowpass filter
-C=2*FS;
-C1LP=(C-(2*pi*F_LPC))/(C+(2*pi*F_LPC));
-C2LP=(2*pi*F_LPC)/((2*pi*F_LPC)+C);
-gain=1;
 
 %% do for each stimulus level
-for m=9
+for m=chans
     display(num2str(m))
+    files=strcat(fullfile(outdir,'TH_'),{'IHC_','ANLS_','ANMS_','ANHS_'},num2str(L(m)),'.mat');
+    if spikes
+        files{5}=fullfile(outdir,['TH_SPK_',num2str(L(m)),'.mat']);
+    end
+    %unseeded runs keep their keys, seeded ones get their own
+    args={nrep,FS,src,prec};
+    if ~isempty(seed)
+        args{end+1}=seed;
+    end
+    if isempty(upkey)
+        CacheKey=StageKey('an',Velocity(:,:,m),Fc,args{:});
+    else
+        CacheKey=StageKey('an',upkey,m,args{:});
+    end
+    statsfile=fullfile(outdir,['TH_AN_',num2str(L(m)),'.stats.json']);
+    if StageCache('get','an',CacheKey,files)
+        display('taken from cache')
+        SaveStats(statsfile,struct('stage','an','cache_key',CacheKey,'cached',true,'seed',seed))
+        continue
+    end
+    stats=struct('stage','an','cache_key',CacheKey,'cached',false,'level',L(m),'wall_time',0,'cf',CF,'seed',seed);
+    stats.ihc_time=zeros(size(CF));
+    stats.an_time=zeros(size(CF));
+    stats.synapse_time=zeros(size(CF));
+    stats.spike_time=zeros(size(CF));
+    SPK=cell(numel(CF),3); %spike times of the LS, MS and HS fiber
+    SPK(:)={zeros(0,1,'uint32')};
+    if ~isempty(seed)
+        rng(seed);
+    end
+    tstart=tic;
     %% do calculations for each simulated section
     for n=2:2:numel(Fc) %do for every other section
         display(num2str(n/2))
-        %% IHC deflection and nonlinearity
-        for k=1:size(Velocity,1);
-            yc(k)=Fgain*Velocity(k,n,m);
-            %VihcNF(k)=Off+Amp*(1./(1+exp(beta*(alpha-yc(k)))));
-            %try the old nonlinearity
-            A0=0.0008;       %0.1 scalar in IHC nonlinear function
-            B=2000*6000;  %2000 par in IHC nonlinear function
-            C=0.33;             %1.74 par in IHC nonlinear function
-            D=200e-9;         %6.87e-9; %par in IHC nonlinear function
-            if yc(k)>=0
-                Apos=A0;
-                VihcNF(k)=Apos.*log(1+B*abs(yc(k)));
-            else
-                Aneg=-A0*(((abs(yc(k)).^C)+D)./((3*abs(yc(k)).^C)+D));
-                VihcNF(k)=Aneg.*log(1+B*abs(yc(k)));
-            end
-        end
-        
-        %% IHC Low-pass filter
-        IHC1=0*ones(LPk+1,1);
-        IHC2=0*ones(LPk+1,1);
-        for k=1:size(Velocity,1);
-            IHC1(1)=gain*VihcNF(k);
-            for r=1:LPk
-                IHC1(r+1)=C1LP*IHC2(r+1)+C2LP*(IHC1(r)+IHC2(r));
-            end
-            
-            for r=1:(LPk+1)
-                IHC2(r)=IHC1(r);
-            end
-            Vihc(k)=IHC1(LPk+1);
-        end %1 section over time
+        %% IHC deflection, nonlinearity and low-pass filter
+        t0=tic;
+        Vihc=IHCStage(Velocity(:,n,m),FS);
+        stats.ihc_time(n/2)=toc(t0);
+        t0=tic;
         
         %% call the auditory nerve model
         if Fc(n)>80; %the AN model only works for freq higher than 80 Hz
             fiberType = 1; %Low spont
-            [ANLS,psthLS] = Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,fiberType,implnt);
+            [ANLS,psthLS,cpuLS,SPK{n/2,1}] = Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,fiberType,implnt);
             fiberType = 2; %Med spont
-            [ANMS,psthMS] = Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,fiberType,implnt);
+            [ANMS,psthMS,cpuMS,SPK{n/2,2}] = Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,fiberType,implnt);
             fiberType = 3; %High spont
-            [ANHS,psthHS] = Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,fiberType,implnt);
+            [ANHS,psthHS,cpuHS,SPK{n/2,3}] = Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,fiberType,implnt);
+            cpu=cpuLS+cpuMS+cpuHS;
+            stats.synapse_time(n/2)=cpu(1);
+            stats.spike_time(n/2)=cpu(2);
         else
             ANLS=NaN(size(Vihc,1),1);
             ANMS=NaN(size(Vihc,1),1);
@@ -85,19 +126,23 @@ for m=9
             psthMS=NaN(size(Vihc,1),1);
             psthHS=NaN(size(Vihc,1),1);
         end
+        stats.an_time(n/2)=toc(t0);
         IHC(:,n/2)=Vihc;
         LS(:,n/2)=ANLS;
         MS(:,n/2)=ANMS;
         HS(:,n/2)=ANHS;
     end %end of all CFs
-    cd '/home/gmehraei/ABRFFRmodel/out/Clicks/'
-    
-    save(['TH_IHC_',num2str(L(m)),'.mat'],'IHC')
-    save(['TH_ANLS_',num2str(L(m)),'.mat'],'LS')
-    save(['TH_AMLS_',num2str(L(m)),'.mat'],'MS')
-    save(['TH_ANHS_',num2str(L(m)),'.mat'],'HS')
+    IHC=cast(IHC,prec); LS=cast(LS,prec); MS=cast(MS,prec); HS=cast(HS,prec);
+    stats.wall_time=toc(tstart);
+    data={struct('IHC',IHC,'CacheKey',CacheKey),struct('LS',LS,'CacheKey',CacheKey),...
+        struct('MS',MS,'CacheKey',CacheKey),struct('HS',HS,'CacheKey',CacheKey)};
+    if spikes
+        data{5}=@(f) SaveSpikes(f,SPK,CF,FS,nrep,floor(size(IHC,1)/nrep),1:3);
+    end
+    AsyncWrite(@SaveResults,files,data,compress,'an',CacheKey,statsfile,stats)
     
     
 end %end for all levels
+AsyncWrite() %wait for the files of the last levels
 %matlabpool(close)
 
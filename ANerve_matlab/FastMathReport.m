@@ -0,0 +1,61 @@
+function err=FastMathReport(infile,m,nrep,cfs)
+% FastMathReport - AN rates and PSTHs of the fast math build against libm
+%
+% Usage: err = FastMathReport(infile,m,nrep,cfs)
+%
+% infile = cochlea output (output.mat of Cochlea/run_cochlear_model.py)
+% m      = stimulus channel (level) of infile, default 1
+% nrep   = repetitions of the stimulus for the PSTH, default 100
+% cfs    = indices of the simulated sections, default every 50th above 80 Hz
+%
+% err    = struct with per section and fiber type (LS, MS, HS) the maximum
+%          error of the rate relative to its maximum (rate), the relative
+%          difference of the spike count (count) and of the PSTH in 1 ms bins
+%          relative to its maximum (psth), which are also printed.
+%
+% Compares Verhulst2014_NOFD_TH (libm) with Verhulst2014_NOFD_TH_fast, the
+% same model compiled with -DAN_FASTMATH (see MEXER.m and fastmath.h). Both
+% get the same random numbers, so the rates only differ by the errors of the
+% fast exp and log and the spike trains by the spikes these move.
+
+if exist('Verhulst2014_NOFD_TH_fast','file')~=3
+    error('FastMathReport:mex','Verhulst2014_NOFD_TH_fast is not built, run MEXER.m first')
+end
+if nargin<2
+    m=1;
+end
+if nargin<3
+    nrep=100;
+end
+load(infile,'Fc','Velocity','model_sample_rate')
+FS=double(model_sample_rate);
+if nargin<4
+    cfs=find(Fc>80);
+    cfs=cfs(1:50:end);
+end
+implnt=0;
+binwidth=1e-3;
+types={'LS','MS','HS'};
+for f=1:3
+    err.(types{f})=struct('rate',zeros(size(cfs)),'count',zeros(size(cfs)),'psth',zeros(size(cfs)));
+end
+fprintf('%10s %4s %10s %10s %10s\n','CF','type','rate','count','psth');
+for c=1:numel(cfs)
+    n=cfs(c);
+    Vihc=repmat(IHCStage(Velocity(:,n,m),FS),1,nrep);
+    for f=1:3
+        rng(f);
+        [rate,~,~,spk]=Verhulst2014_NOFD_TH(Vihc,Fc(n),nrep,1/FS,f,implnt);
+        rng(f);
+        [ratef,~,~,spkf]=Verhulst2014_NOFD_TH_fast(Vihc,Fc(n),nrep,1/FS,f,implnt);
+        info=struct('FS',FS,'nrep',nrep,'duration',floor(numel(Vihc)/nrep));
+        psth=SpikePSTH(spk,info,binwidth);
+        psthf=SpikePSTH(spkf,info,binwidth);
+        e=err.(types{f});
+        e.rate(c)=max(abs(ratef(:)-rate(:)))/max(abs(rate(:)));
+        e.count(c)=abs(numel(spkf)-numel(spk))/max(numel(spk),1);
+        e.psth(c)=max(abs(psthf-psth))/max(max(psth),1);
+        err.(types{f})=e;
+        fprintf('%10.1f %4s %10.2e %10.2e %10.2e\n',Fc(n),types{f},e.rate(c),e.count(c),e.psth(c));
+    end
+end
@@ -0,0 +1,58 @@
+function Vihc=IHCStage(V,FS)
+% IHCStage - inner hair cell receptor potential of one cochlear section
+%
+% Usage: Vihc = IHCStage(V,FS)
+%
+% V    = BM velocity of the section over time (Velocity(:,n,m) of the
+%        cochlea output), single or double
+% FS   = sample rate in Hz
+%
+% Vihc = IHC potential [1 x time], the input of Verhulst2014_NOFD_TH
+%
+% The velocity is scaled to a cilia displacement, passed through the
+% asymmetric log nonlinearity and the IHC low-pass filter (a la Zilany et
+% al., with a lower cut-off).
+
+Mvel=41e-6; %from 1 kHz max BM vel from Heinz Stimuli 100dB.. %0.09645;, where the fuck does this high value come from.. %Max BM velocity in the model
+Mu=200e-9;  %Max cilia displacement in the model
+Fgain=Mu/Mvel;
+
+%for the IHC low-pass filter a la Zilany et al., with different
+%cut-off here 2.5 iso 3800/3000kHz in Zilany!
+F_LPC=1000; % 2500; %4500;     %4500 in Heinz model! %3800/3000 in zilani in original  %IHC lowpass cutoff frequency, Heinz uses 4500Hz
+LPk=2 ; %7;         %order of the lowpass filter
+C=2*FS;
+C1LP=(C-(2*pi*F_LPC))/(C+(2*pi*F_LPC));
+C2LP=(2*pi*F_LPC)/((2*pi*F_LPC)+C);
+gain=1;
+
+%% IHC deflection and nonlinearity
+%all samples at once, so log and the power run vectorized
+yc=Fgain*double(V(:)');
+%VihcNF=Off+Amp*(1./(1+exp(beta*(alpha-yc))));
+%try the old nonlinearity
+A0=0.0008;       %0.1 scalar in IHC nonlinear function
+B=2000*6000;  %2000 par in IHC nonlinear function
+C=0.33;             %1.74 par in IHC nonlinear function
+D=200e-9;         %6.87e-9; %par in IHC nonlinear function
+VihcNF=A0*log(1+B*abs(yc));
+neg=yc<0;
+yC=abs(yc(neg)).^C;
+Aneg=-A0*((yC+D)./((3*yC)+D));
+VihcNF(neg)=Aneg.*log(1+B*abs(yc(neg)));
+
+%% IHC Low-pass filter
+IHC1=0*ones(LPk+1,1);
+IHC2=0*ones(LPk+1,1);
+Vihc=zeros(1,numel(V));
+for k=1:numel(V);
+    IHC1(1)=gain*VihcNF(k);
+    for r=1:LPk
+        IHC1(r+1)=C1LP*IHC2(r+1)+C2LP*(IHC1(r)+IHC2(r));
+    end
+
+    for r=1:(LPk+1)
+        IHC2(r)=IHC1(r);
+    end
+    Vihc(k)=IHC1(LPk+1);
+end %1 section over time
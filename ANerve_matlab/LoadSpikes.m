@@ -0,0 +1,41 @@
+function [spikes,info]=LoadSpikes(file,cfIdx)
+% LoadSpikes - spike trains of some CFs of a spike store (see SaveSpikes)
+%
+% Usage: [spikes,info] = LoadSpikes(file,cfIdx)
+%
+% file   = mat file of the store
+% cfIdx  = indices of the CFs to load (default all)
+%
+% spikes = cell array [numel(cfIdx) x fiber] with the spike times of every
+%          fiber as uint32 sample indices (0-based, over all repetitions)
+% info   = struct with CF, FS, nrep, duration and the fiber types
+%
+% Only the index of the store and the spikes of the requested CFs are read
+% from the file.
+
+m=matfile(file);
+info=struct('CF',m.CF,'FS',m.FS,'nrep',m.nrep,'duration',m.duration);
+index=m.SpikeIndex;
+nCF=numel(info.CF);
+nFib=size(index,1)/nCF;
+types=m.SpikeType;
+info.types=types(1:nFib)';
+if nargin<2
+    cfIdx=1:nCF;
+end
+
+spikes=cell(numel(cfIdx),nFib);
+for c=1:numel(cfIdx)
+    %the fibers of a CF are one range of the store
+    rows=(cfIdx(c)-1)*nFib+(1:nFib);
+    first=index(rows(1),1);
+    last=index(rows(end),1)+index(rows(end),2)-1;
+    d=zeros(0,1,'uint32');
+    if last>=first
+        d=m.SpikeDelta(first:last,1);
+    end
+    for k=1:nFib
+        n=index(rows(k),2);
+        spikes{c,k}=cumsum(d(index(rows(k),1)-first+(1:n)));
+    end
+end
@@ -10,7 +10,11 @@ clear all;
 %mex -f /home/sarah/Documents/MATLAB/mexopts.sh -v zilany2009_NOFD_noMatch.c complex.c
 
 %mex -f /home/staralfur/Documents/MATLAB/mexopts.sh -v Verhulst2014_NOFD.c complex.c
-mex -f /home/staralfur/Documents/MATLAB/mexopts.sh -v Verhulst2014_NOFD_TH.c complex.c
+%-O3 vectorizes the block scan of the spike generator, add -march=native for
+%AVX if the MEX only runs on this kind of machine
+mex -f /home/staralfur/Documents/MATLAB/mexopts.sh -v COPTIMFLAGS='-O3 -DNDEBUG' Verhulst2014_NOFD_TH.c complex.c
+%the same with the fast exp and log of fastmath.h, compare with FastMathReport
+mex -f /home/staralfur/Documents/MATLAB/mexopts.sh -v COPTIMFLAGS='-O3 -DNDEBUG' -DAN_FASTMATH -output Verhulst2014_NOFD_TH_fast Verhulst2014_NOFD_TH.c complex.c
 mex -f /home/staralfur/Documents/MATLAB/mexopts.sh -v model_Synapse.c complex.c
 %mex -f /home/staralfur/Documents/MATLAB/mexopts.sh -v model_Synapse_CI.c complex.c
 %mex -f /home/sarah/Documents/MATLAB/mexopts.sh -v Verhulst2014_NOFD_PLA.c complex.c
@@ -0,0 +1,44 @@
+function SaveSpikes(file,spikes,CF,FS,nrep,duration,types)
+% SaveSpikes - save spike trains in the compact spike store format
+%
+% Usage: SaveSpikes(file,spikes,CF,FS,nrep,duration,types)
+%
+% file     = mat file of the store
+% spikes   = cell array [CF x fiber] with the spike times of every fiber as
+%            sample indices (0-based, over all repetitions), e.g. the 4th
+%            output of Verhulst2014_NOFD_TH, empty for no spikes
+% CF       = characteristic frequency of every row of spikes
+% FS       = sample rate in Hz
+% nrep     = number of stimulus repetitions
+% duration = samples per repetition
+% types    = fiber type of every column of spikes (default 1:columns)
+%
+% The spike times are stored as uint32 differences to the previous spike of
+% the same fiber (SpikeDelta), the fibers one after the other and CF by CF,
+% with per fiber the first entry and the number of spikes (SpikeIndex) and
+% its CF index and type (SpikeCF, SpikeType). The file is saved as -v7.3,
+% so LoadSpikes reads the spikes of a few CFs without loading the rest.
+
+[nCF,nFib]=size(spikes);
+if nargin<7
+    types=1:nFib;
+end
+counts=cellfun(@numel,spikes)';
+counts=counts(:); %fiber by fiber, CF by CF
+SpikeIndex=[cumsum([1;counts(1:end-1)]) counts];
+SpikeCF=reshape(repmat(1:nCF,nFib,1),[],1);
+SpikeType=reshape(repmat(types(:),1,nCF),[],1);
+SpikeDelta=zeros(sum(counts),1,'uint32');
+f=0;
+for c=1:nCF
+    for k=1:nFib
+        f=f+1;
+        s=uint32(spikes{c,k}(:));
+        if isempty(s)
+            continue
+        end
+        SpikeDelta(SpikeIndex(f,1)+(0:numel(s)-1))=[s(1);diff(s)];
+    end
+end
+CF=CF(:);
+save(file,'SpikeDelta','SpikeIndex','SpikeCF','SpikeType','CF','FS','nrep','duration','-v7.3')
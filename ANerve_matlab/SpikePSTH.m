@@ -0,0 +1,27 @@
+function psth=SpikePSTH(spikes,info,binwidth)
+% SpikePSTH - PSTH of spike trains at a chosen bin width
+%
+% Usage: psth = SpikePSTH(spikes,info,binwidth)
+%
+% spikes   = spike times as sample indices, one train or a cell array of
+%            trains (see LoadSpikes)
+% info     = struct with FS, nrep and duration of the trains (see LoadSpikes)
+% binwidth = bin width in s (default 1/FS, the psth of Verhulst2014_NOFD_TH)
+%
+% psth     = spike counts per bin, summed over the repetitions [bin x train],
+%            divide by nrep*binwidth for the rate in spikes/s
+
+if nargin<3
+    binwidth=1/info.FS;
+end
+if ~iscell(spikes)
+    spikes={spikes};
+end
+bin=binwidth*info.FS; %samples per bin
+nbins=ceil(info.duration/bin);
+psth=zeros(nbins,numel(spikes));
+for k=1:numel(spikes)
+    %the repetitions are folded onto one
+    b=floor(mod(double(spikes{k}(:)),info.duration)/bin)+1;
+    psth(:,k)=accumarray(b,1,[nbins 1]);
+end
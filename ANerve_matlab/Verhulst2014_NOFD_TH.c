@@ -34,8 +34,12 @@
 /* #include <iostream.h> */
 
 #include "complex.hpp"
+#include "fastmath.h"
 
 #define MAXSPIKES 1000000
+#ifndef SPIKEBLOCK
+#define SPIKEBLOCK 64  /* Bins per block of SpikeGeneratorScan, 0 for the bin by bin SpikeGenerator */
+#endif
 #ifndef TWOPI
 #define TWOPI 6.28318530717959
 #endif
@@ -58,9 +62,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
 	double *pxtmp, *cftmp, *nreptmp, *tdrestmp, *fibertypetmp, *implnttmp;
         
-    double *synout, *psth;
+    double *synout, *psth, *timing;
+    mxArray **spikes;
    
-	void   SingleAN(double *, double, int, double, int, double, double, double *, double *);
+	void   SingleAN(double *, double, int, double, int, double, double, double *, double *, double *, mxArray **);
 	
 	/* Check for proper number of arguments */
 	
@@ -69,9 +74,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 		mexErrMsgTxt("zilany2009_humanized1_Synapse requires 6 input arguments.");
 	}; 
 
-	if (nlhs != 2)  
+	if ((nlhs < 2) || (nlhs > 4))  
 	{
-		mexErrMsgTxt("zilany2009_humanized1_Synapse requires 2 output argument.");
+		mexErrMsgTxt("zilany2009_humanized1_Synapse requires 2 to 4 output arguments.");
 	};
 	
 	/* Assign pointers to the inputs */
@@ -131,18 +136,31 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 	
 	synout	= mxGetPr(plhs[0]);
     psth	= mxGetPr(plhs[1]);
+
+    /* optional third output: CPU seconds of the Synapse and the SpikeGenerator */
+    timing = NULL;
+    if (nlhs >= 3)
+    {
+        plhs[2] = mxCreateDoubleMatrix(1, 2, mxREAL);
+        timing = mxGetPr(plhs[2]);
+    }
+    /* optional fourth output: the spikes as uint32 sample indices (0-based,
+       over all repetitions), the bins of psth before the repetitions are folded */
+    spikes = NULL;
+    if (nlhs == 4)
+        spikes = &plhs[3];
 			
 	/* run the model */
 
 	mexPrintf("zilany2009_humanized/Heinz2001/Verhulst2014 - NO FD - NO PLA: Zilany, Bruce, Nelson, and Carney, Heinz, Verhulst : Auditory Nerve Model\n");
 
-	SingleAN(px,cf,nrep,tdres,totalstim,fibertype,implnt,synout,psth);
+	SingleAN(px,cf,nrep,tdres,totalstim,fibertype,implnt,synout,psth,timing,spikes);
 
  mxFree(px);
 
 }
 
-void SingleAN(double *px, double cf, int nrep, double tdres, int totalstim, double fibertype, double implnt, double *synout, double *psth)
+void SingleAN(double *px, double cf, int nrep, double tdres, int totalstim, double fibertype, double implnt, double *synout, double *psth, double *timing, mxArray **spikes)
 {	
         	
 	/*variables for the signal-path, control-path and onward */
@@ -150,11 +168,14 @@ void SingleAN(double *px, double cf, int nrep, double tdres, int totalstim, doub
 
 	int    i,nspikes,ipst;
 	double I,spont;
+    unsigned int *spikeidx;
+    clock_t start;
     double sampFreq = 10e3; /* Sampling frequency used in the synapse */
         
     /* Declarations of the functions used in the program */
 	double Synapse(double *, double, double, int, int, double, double, double, double *);
 	int    SpikeGenerator(double *, double, int, int, double *);
+	int    SpikeGeneratorScan(double *, double, int, int, double *);
     
     /* Allocate dynamic memory for the temporary variables */
     synouttmp  = (double*)mxCalloc(totalstim*nrep,sizeof(double));
@@ -167,7 +188,9 @@ void SingleAN(double *px, double cf, int nrep, double tdres, int totalstim, doub
     if (fibertype==3) spont = 60; /*100.0*/ 
    
     /*====== Run the synapse model ======*/    
+    start = clock();
     I = Synapse(px, tdres, cf, totalstim, nrep, spont, implnt, sampFreq, synouttmp);
+    if (timing) timing[0] = (double)(clock()-start)/CLOCKS_PER_SEC;
             
     /* Wrapping up the unfolded (due to no. of repetitions) Synapse Output */
     for(i = 0; i <I ; i++)
@@ -177,11 +200,24 @@ void SingleAN(double *px, double cf, int nrep, double tdres, int totalstim, doub
 	};    
     /*======  Spike Generations ======*/
     
-	nspikes = SpikeGenerator(synouttmp, tdres, totalstim, nrep, sptime);
+    start = clock();
+	if (SPIKEBLOCK>0)
+        nspikes = SpikeGeneratorScan(synouttmp, tdres, totalstim, nrep, sptime);
+    else
+        nspikes = SpikeGenerator(synouttmp, tdres, totalstim, nrep, sptime);
+    if (timing) timing[1] = (double)(clock()-start)/CLOCKS_PER_SEC;
+    spikeidx = NULL;
+    if (spikes)
+    {
+        *spikes = mxCreateNumericMatrix(nspikes, 1, mxUINT32_CLASS, mxREAL);
+        spikeidx = (unsigned int *) mxGetData(*spikes);
+    }
 	for(i = 0; i < nspikes; i++)
 	{        
 		ipst = (int) (fmod(sptime[i],tdres*totalstim) / tdres);
         psth[ipst] = psth[ipst] + 1;       
+        if (spikeidx)
+            spikeidx[i] = (unsigned int) (floor(sptime[i]/(tdres*totalstim))*totalstim + ipst);
 	};
 
     /* Freeing dynamic memory allocated earlier */
@@ -205,7 +241,7 @@ double Synapse(double *ihcout, double tdres, double cf, int totalstim, int nrep,
     int    k,j,indx,i;    
     double synstrength,synslope,CI,CL,PG,CG,VL,PL,VI;
 	double cf_factor,PImax,kslope,Ass,Asp,TauR,TauST,Ar_Ast,PTS,Aon,AR,AST,Prest,gamma1,gamma2,k1,k2;
-	double VI0,VI1,alpha,beta,theta1,theta2,theta3,vsat,Kcf,matching,tmpst,tmp,PPI,CIlast,temp,PI1,PI2,Asus,Asusmax,FTH,Vsatmax,SRTH;
+	double VI0,VI1,alpha,beta,theta1,theta2,theta3,vsat,Kcf,matching,tmpst,tmp,PPI,CIlast,temp,PI1,PI2,Asus,Asusmax,FTH,Vsatmax,SRTH,SRshift;
             
     double *sout1, *sout2, *synSampOut, *powerLawIn, *exponOut, *TmpSyn;            
     double *m1, *m2, *m3, *m4, *m5;
@@ -309,14 +345,16 @@ double Synapse(double *ihcout, double tdres, double cf, int totalstim, int nrep,
        Asusmax=PL*PG*CG/(PL+PG); /*checking parameters*/
        Asus=(AR+AST)/(PTS-1);    /*should be Ass for steady state to step pulse*/
        
+       SRshift=SRTH/AN_EXP(spont); /*threshold shift with SR, the same for all samples*/
+       
        k = 0;     
        for (indx=0; indx<totalstim*nrep; ++indx)
        {              
                 
             /*permeability is rectifier function */
            /*PPI=((PI2-PI1)/(Vsatmax-FTH))*(ihcout[indx]-(SRTH/exp(spont)))+PI1; /*linear function between firing threshold and PI of 80. Threshold shifts with SR*/
-           PPI=((PI2-PI1)/(Vsatmax))*(ihcout[indx]-(SRTH/exp(spont)))+PI1;
-           if(ihcout[indx]<=FTH+(SRTH/exp(spont))) PPI=PI1; /*if below threshold, at PI2rest, so that firing is constant at SR */   
+           PPI=((PI2-PI1)/(Vsatmax))*(ihcout[indx]-SRshift)+PI1;
+           if(ihcout[indx]<=FTH+SRshift) PPI=PI1; /*if below threshold, at PI2rest, so that firing is constant at SR */   
            if(k==0) PPI=PI1;  
         
             CIlast = CI;        
@@ -493,15 +531,15 @@ int SpikeGenerator(double *synouttmp, double tdres, int totalstim, int nrep, dou
 	refracMult1 = 1 - tdres/s1;  /* If y1(t) = c1*exp(-t/s1), then y1(t+tdres) = y1(t)*refracMult1 */
 
 	/* Calculate effects of a random spike before t=0 on refractoriness and the time-warping sum at t=0 */
-    endOfLastDeadtime = __max(0,log(randNums[randBufIndex++]) / synouttmp[0] + dead);  /* End of last deadtime before t=0 */
-    refracValue0 = c0*exp(endOfLastDeadtime/s0);     /* Value of first exponential in refractory function */
-	refracValue1 = c1*exp(endOfLastDeadtime/s1);     /* Value of second exponential in refractory function */
-	Xsum = synouttmp[0] * (-endOfLastDeadtime + c0*s0*(exp(endOfLastDeadtime/s0)-1) + c1*s1*(exp(endOfLastDeadtime/s1)-1));  
+    endOfLastDeadtime = __max(0,AN_LOG(randNums[randBufIndex++]) / synouttmp[0] + dead);  /* End of last deadtime before t=0 */
+    refracValue0 = c0*AN_EXP(endOfLastDeadtime/s0);     /* Value of first exponential in refractory function */
+	refracValue1 = c1*AN_EXP(endOfLastDeadtime/s1);     /* Value of second exponential in refractory function */
+	Xsum = synouttmp[0] * (-endOfLastDeadtime + c0*s0*(AN_EXP(endOfLastDeadtime/s0)-1) + c1*s1*(AN_EXP(endOfLastDeadtime/s1)-1));  
         /* Value of time-warping sum */
 		/*  ^^^^ This is the "integral" of the refractory function ^^^^ (normalized by 'tdres') */
 
 	/* Calculate first interspike interval in a homogeneous, unit-rate Poisson process (normalized by 'tdres') */
-    unitRateIntrvl = -log(randNums[randBufIndex++])/tdres;  
+    unitRateIntrvl = -AN_LOG(randNums[randBufIndex++])/tdres;  
 	    /* NOTE: Both 'unitRateInterval' and 'Xsum' are divided (or normalized) by 'tdres' in order to reduce calculation time.  
 		This way we only need to divide by 'tdres' once per spike (when calculating 'unitRateInterval'), instead of 
 		multiplying by 'tdres' once per time bin (when calculating the new value of 'Xsum').                         */
@@ -516,7 +554,7 @@ int SpikeGenerator(double *synouttmp, double tdres, int totalstim, int nrep, dou
 			if ( Xsum >= unitRateIntrvl )  /* Spike occurs when time-warping sum exceeds interspike "time" in unit-rate process */
 			{
 				sptime[Nout] = countTime; Nout = Nout+1;								
-				unitRateIntrvl = -log(randNums[randBufIndex++]) /tdres; 
+				unitRateIntrvl = -AN_LOG(randNums[randBufIndex++]) /tdres; 
                  Xsum = 0;
 				
 			    /* Increase index and time to the last time bin in the deadtime, and reset (relative) refractory function */
@@ -533,3 +571,116 @@ int SpikeGenerator(double *synouttmp, double tdres, int totalstim, int nrep, dou
 	return(nspikes);
 }
 
+
+/* ------------------------------------------------------------------------------------ */
+/* The same spike generator, with the rate vector scanned in blocks of SPIKEBLOCK bins.
+
+   Between spikes the refractory function decays as c0*refracMult0^k + c1*refracMult1^k, 
+   so within a block the increments of the time-warping sum only depend on the refractory 
+   values at the start of the block. They are computed in one loop without branches, which 
+   the compiler vectorizes, and only a block whose sum reaches 'unitRateIntrvl' is searched 
+   bin by bin for the spike. The random numbers are drawn as in SpikeGenerator, so both give 
+   the same spikes up to rounding of the time-warping sum.
+*/
+
+int SpikeGeneratorScan(double *synouttmp, double tdres, int totalstim, int nrep, double *sptime) 
+{  
+   	double  c0,s0,c1,s1,dead;
+    int     k,j,n,kend,NoutMax,Nout,deadtimeIndex,randBufIndex;      
+    double	endOfLastDeadtime, refracMult0, refracMult1, refracValue0, refracValue1;
+    double	Xsum, unitRateIntrvl, DT, sum0, sum1, sum2, sum3;    
+    double  pow0[SPIKEBLOCK>0 ? SPIKEBLOCK : 1], pow1[SPIKEBLOCK>0 ? SPIKEBLOCK : 1], incr[SPIKEBLOCK>0 ? SPIKEBLOCK : 1];
+    
+    mxArray	*randInputArray[1], *randOutputArray[1];
+    double *randNums, *randDims;    
+    
+    c0      = 0.5;
+	s0      = 0.001;
+	c1      = 0.5;
+	s1      = 0.0125;
+    dead    = 0.00075;
+    
+    DT = totalstim * tdres * nrep;  /* Total duration of the rate function */
+    Nout = 0;
+    NoutMax = (long) ceil(totalstim*nrep*tdres/dead);    
+       
+    randInputArray[0] = mxCreateDoubleMatrix(1, 2, mxREAL);
+    randDims = mxGetPr(randInputArray[0]);
+    randDims[0] = 1;
+    randDims[1] = NoutMax+1;
+    mexCallMATLAB(1, randOutputArray, 1, randInputArray, "rand");
+    randNums = mxGetPr(randOutputArray[0]);
+    randBufIndex = 0;
+    
+	deadtimeIndex = (long) floor(dead/tdres);  /* Integer number of discrete time bins within deadtime */
+
+	refracMult0 = 1 - tdres/s0;
+	refracMult1 = 1 - tdres/s1;
+    pow0[0] = 1; pow1[0] = 1;  /* Decay of the refractory function over j bins */
+    for (j=1; j<SPIKEBLOCK; j++)
+    {
+        pow0[j] = pow0[j-1]*refracMult0;
+        pow1[j] = pow1[j-1]*refracMult1;
+    }
+    
+    /* Bins with (k+1)*tdres < DT, i.e. countTime<DT in SpikeGenerator */
+    kend = totalstim*nrep;
+    while (kend>0 && kend*tdres>=DT) kend--;
+
+	/* Effects of a random spike before t=0, as in SpikeGenerator */
+    endOfLastDeadtime = __max(0,AN_LOG(randNums[randBufIndex++]) / synouttmp[0] + dead);
+    refracValue0 = c0*AN_EXP(endOfLastDeadtime/s0);
+	refracValue1 = c1*AN_EXP(endOfLastDeadtime/s1);
+	Xsum = synouttmp[0] * (-endOfLastDeadtime + c0*s0*(AN_EXP(endOfLastDeadtime/s0)-1) + c1*s1*(AN_EXP(endOfLastDeadtime/s1)-1));  
+    unitRateIntrvl = -AN_LOG(randNums[randBufIndex++])/tdres;  
+
+    k = 0;
+	while (k<kend)  /* Loop through rate vector, block by block */
+	{
+        n = __min(SPIKEBLOCK, kend-k);
+        for (j=0; j<n; j++)  /* Non-positive rates add nothing */
+            incr[j] = __max(synouttmp[k+j],0)*(1 - refracValue0*pow0[j] - refracValue1*pow1[j]);
+        sum0 = 0; sum1 = 0; sum2 = 0; sum3 = 0;
+        for (j=0; j+4<=n; j+=4)
+        {
+            sum0 += incr[j]; sum1 += incr[j+1]; sum2 += incr[j+2]; sum3 += incr[j+3];
+        }
+        for (; j<n; j++) sum0 += incr[j];
+        
+        /* With the refractory function below 1 all increments are positive, so the sum 
+           only reaches 'unitRateIntrvl' if it does at the end of the block */
+        if (refracValue0+refracValue1<=1 && Xsum+((sum0+sum1)+(sum2+sum3))<unitRateIntrvl)
+        {
+            Xsum += (sum0+sum1)+(sum2+sum3);
+        }
+        else
+        {
+            for (j=0; j<n; j++)
+            {
+                if (synouttmp[k+j]>0)
+                {
+                    Xsum += incr[j];
+                    if (Xsum>=unitRateIntrvl) break;
+                }
+            }
+            if (j<n)  /* Spike in bin k+j */
+            {
+                sptime[Nout] = (k+j+1)*tdres; Nout = Nout+1;
+                unitRateIntrvl = -AN_LOG(randNums[randBufIndex++]) /tdres; 
+                Xsum = 0;
+                
+                /* Continue after the deadtime with the refractory function reset */
+                k += j+deadtimeIndex+1;
+                refracValue0 = c0*refracMult0;
+                refracValue1 = c1*refracMult1;
+                continue;
+            }
+        }
+        refracValue0 *= pow0[n-1]*refracMult0;
+        refracValue1 *= pow1[n-1]*refracMult1;
+        k += n;
+	} /* End of rate vector loop */			
+            
+    mxDestroyArray(randInputArray[0]); mxDestroyArray(randOutputArray[0]);	
+	return(Nout);  /* Number of spikes that occurred. */
+}
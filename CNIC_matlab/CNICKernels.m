@@ -0,0 +1,33 @@
+function K=CNICKernels(N,FS)
+% CNICKernels - excitatory and inhibitory kernels of the CN and IC stages
+%
+% Usage: K = CNICKernels(N,FS)
+%
+% N  = number of samples of the (resampled) AN response
+% FS = sampling rate of the CN/IC stage in Hz
+%
+% K  = struct with the kernels ex, Inhcn, Inhic, the delays Dcn, Dic in
+%      samples and the gains Acn, Aic. The kernels only depend on N and FS,
+%      so they are built once and reused for every CF.
+
+Acn=1.5;
+Aic=1;
+Scn=0.6;
+Sic=1.5;
+Dcn=1e-3;
+Dic=2e-3;
+Tex=0.5e-3;
+Tin=2e-3;
+t=[0:N-1]/FS';
+
+K.Acn=Acn;
+K.Aic=Aic;
+K.Dcn=round(Dcn*FS);
+K.Dic=round(Dic*FS);
+K.ex=(1/Tex^2)*t.*exp(-t/Tex);
+
+K.Inhcn=[zeros(1,K.Dcn)  Scn*(1/Tin^2)*(t).*exp(-(t)/Tin)];
+K.Inhcn(end-K.Dcn+1:end)=[];
+
+K.Inhic=[zeros(1,K.Dic)  Sic*(1/Tin^2)*(t).*exp(-(t)/Tin)];
+K.Inhic(end-K.Dic+1:end)=[];
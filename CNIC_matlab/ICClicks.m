@@ -1,123 +1,124 @@
-function ICClicks(name,Neuro)
+function ICClicks(name,Neuro,opts)
+%Neuro can be a vector of settings (see NeuroProfile), which are all
+%computed from a single pass over the AN files, or opts.profiles can hold
+%custom synaptopathy profiles.
+%opts.perCF=1 also saves the per-CF responses RicF/RcnF (off by default),
+%opts.cfIdx/opts.cfWeights select the CFs of the population responses,
+%see ICPopulation
+%opts.L, opts.andir and opts.outdir set the levels, the directory of the AN
+%files and the output directory
+%opts.compress=0 saves the IC files uncompressed (faster to write, larger),
+%the files of a level are written on a background thread while the next
+%level is computed (see AsyncWrite)
+%The timings of every level (loading, per profile and, with opts.perCF, per
+%CF) go to the sidecar IC<name><L>.stats.json (see SaveStats)
 
 %single channel load.
 L=0:10:100;
 tic
+addpath(fullfile(pwd,'..','sysfiles')) %StageKey, StageCache, SaveStats, AsyncWrite
 load CFs.mat
-%L=75; 
+%L=75;
 %name='NHClicksME';
 %Neuro=1;
 %Neuro=3;
-Ncut=find(CF>1000,1,'last') %indices below this boundary have HF neuropathy
-
-TF=20; %total no of fibers synapsing onto CN
-if Neuro==1
-    rLS=0;%round(15/100*TF); %in percentage of total population
-    rMS=0;%round(20/100*TF)-1;
-    rHS=round(65/100*TF);
-elseif Neuro==2
-    rLS=0;%round(15/100*TF); %in percentage of total population
-    rMS=0;%round(20/100*TF)-1;
-    rHS=round(round(65/100*TF)/2);
-elseif Neuro==3 || 4  %freq specific neuropathy
-    rLSN=0;
-    rMSN=0;
-    rHSN=0;
-    rLS=round(15/100*TF); %in percentage of total population
-    rMS=round(20/100*TF)-1;
-    rHS=round(65/100*TF);    
+if nargin<3
+    opts=struct;
+end
+if ~isfield(opts,'perCF')
+    opts.perCF=0;
+end
+if isfield(opts,'L')
+    L=opts.L;
+end
+if ~isfield(opts,'andir')
+    opts.andir='../ANerve_matlab/out/Clicks/';
+end
+if ~isfield(opts,'outdir')
+    opts.outdir='./out/Clicks/';
+end
+if ~isfield(opts,'compress')
+    opts.compress=1;
+end
+%synaptopathy profiles, all computed from one load of the AN files
+if isfield(opts,'profiles')
+    profiles=opts.profiles;
 else
-    rLS=round(15/100*TF); %in percentage of total population
-    rMS=round(20/100*TF)-1;
-    rHS=round(65/100*TF);    
+    for p=1:numel(Neuro)
+        profiles(p)=NeuroProfile(CF,Neuro(p));
+    end
 end
-TFtot=19;
-%ratios for LS/HS in pct
-
-IC=0; W1=0; CN=0;
 
+%the IC stage depends on the code of the CN/IC model
+src=cellfun(@(f) fileread(which(f)),{'ICPopulation','ICScenarios','CNICKernels'},'UniformOutput',false);
 
 for k=1:numel(L)
     disp(num2str(L(k)))
-     
-    load (['../ANerve_matlab/out/Clicks/',name,'ANLS_',num2str(L(k)),'.mat'])
-    load (['../ANerve_matlab/out/Clicks/',name,'ANMS_',num2str(L(k)),'.mat'])
-    load (['../ANerve_matlab/out/Clicks/',name,'ANHS_',num2str(L(k)),'.mat'])
-
-    
-    for n=1:size(HS,2)
-        disp(num2str(n))
-        %sampling rate down to 20kHz
-        ANHS=resample(HS(:,n),1,5);
-        ANMS=resample(MS(:,n),1,5);
-        ANLS=resample(LS(:,n),1,5);
-    
-        FS=20000;
-       
-        Acn=1.5;
-        Aic=1;
-        Scn=0.6;
-        Sic=1.5;
-        Dcn=1e-3;
-        Dic=2e-3;
-        Tex=0.5e-3;
-        Tin=2e-3;
-        t=[0:size(ANHS,1)-1]/FS';
-
-        Inhcn=[zeros(1,round(Dcn*FS))  Scn*(1/Tin^2)*(t).*exp(-(t)/Tin)];
-        Inhcn(end-round(Dcn*FS)+1:end)=[];
 
-        Inhic=[zeros(1,round(Dic*FS))  Sic*(1/Tin^2)*(t).*exp(-(t)/Tin)];
-        Inhic(end-round(Dic*FS)+1:end)=[];
-         
-        if Neuro==3
-            if  CF(n)>Ncut %for the neuropathy region HF
-                AN=(rLSN*ANLS+rHSN*ANHS+rMSN*ANMS)/(TFtot);
-            else
-                AN=(rLS*ANLS+rHS*ANHS+rMS*ANMS)/(TFtot);
-            end
-        elseif Neuro==4
-           	if  CF(n)<Ncut %for the neuropathy region LF
-                AN=(rLSN*ANLS+rHSN*ANHS+rMSN*ANMS)/(TFtot);
-            else
-                AN=(rLS*ANLS+rHS*ANHS+rMS*ANMS)/(TFtot);
-            end     
+    anfiles=strcat(fullfile(opts.andir,name),{'ANLS_','ANMS_','ANHS_'},num2str(L(k)),'.mat');
+    files={};
+    for p=1:numel(profiles)
+        files{end+1}=[fullfile(opts.outdir,'IC'),name,num2str(L(k)),profiles(p).name,'.mat'];
+        if opts.perCF
+            files{end+1}=[fullfile(opts.outdir,'IC'),name,num2str(L(k)),'resp',profiles(p).name,'.mat'];
+        end
+    end
+    %keys of the AN files stand for their contents, if they were saved with one
+    ankeys=cell(size(anfiles));
+    for f=1:numel(anfiles)
+        if ismember('CacheKey',who('-file',anfiles{f}))
+            ankeys{f}=load(anfiles{f},'CacheKey');
         else
-            AN=(rLS*ANLS+rHS*ANHS+rMS*ANMS)/(TFtot);
+            fid=fopen(anfiles{f}); ankeys{f}=fread(fid,inf,'*uint8'); fclose(fid);
         end
-        
-        Rcn=Acn*(conv((1/Tex^2)*t.*exp(-t/Tex),AN)-conv(Inhcn,circshift(AN,round(Dcn*FS))));
-        Ric=Aic*(conv((1/Tex^2)*t.*exp(-t/Tex),Rcn)-conv(Inhic,circshift(Rcn,round(Dic*FS))));
-
-    %% here only summed until 175Hz
-    %population responses
-    if n<=433 %the summed response for the case
-        W1=W1+AN(1:numel(AN)); %add them up one by one
-        CN=CN+Rcn(1:numel(AN)); %add them up one by one
-        IC=IC+Ric(1:numel(AN)); %add them up one by one
     end
+    ickey=StageKey('ic',ankeys,profiles,rmfield(opts,intersect(fieldnames(opts),{'L','andir','outdir','compress'})),src);
+    statsfile=[fullfile(opts.outdir,'IC'),name,num2str(L(k)),'.stats.json'];
+    if StageCache('get','ic',ickey,files)
+        disp('taken from cache')
+        SaveStats(statsfile,struct('stage','ic','cache_key',ickey,'cached',true))
+        continue
+    end
+    stats=struct('stage','ic','cache_key',ickey,'cached',false,'level',L(k),'wall_time',0,'load_time',0);
+    stats.profiles={profiles.name};
+    stats.profile_time=zeros(1,numel(profiles));
+    tstart=tic;
 
-     RicF(n,:)=Ric(1:numel(AN));
-     RcnF(n,:)=Rcn(1:numel(AN));
-    
-end
-toc
+    load (anfiles{1})
+    load (anfiles{2})
+    load (anfiles{3})
+    %the AN files can be saved in single precision (see ANClick)
+    LS=double(LS); MS=double(MS); HS=double(HS);
+    stats.load_time=toc(tstart);
 
-if Neuro==1
-    save(['./out/Clicks/IC',name,num2str(L(k)),'_HS.mat'],'IC','CN','W1')
-    save(['./out/Clicks/IC',name,num2str(L(k)),'resp_HS.mat'],'RicF','RcnF')
-elseif Neuro==2
-    save(['./out/Clicks/IC',name,num2str(L(k)),'_HS50.mat'],'IC','CN','W1')
-    save(['./out/Clicks/IC',name,num2str(L(k)),'resp_HS50.mat'],'RicF','RcnF')
-elseif Neuro==3
-    save(['./out/Clicks/IC',name,num2str(L(k)),'_HSHF.mat'],'IC','CN','W1')
-    save(['./out/Clicks/IC',name,num2str(L(k)),'resp_HSHF.mat'],'RicF','RcnF')
-elseif Neuro==4
-    save(['./out/Clicks/IC',name,num2str(L(k)),'_HSLF.mat'],'IC','CN','W1')
-    save(['./out/Clicks/IC',name,num2str(L(k)),'resp_HSLF.mat'],'RicF','RcnF')
-else
-    save(['./out/Clicks/IC',name,num2str(L(k)),'_Mix.mat'],'IC','CN','W1')
-    save(['./out/Clicks/IC',name,num2str(L(k)),'resp_Mix.mat'],'RicF','RcnF')
-end
+    %% population responses
+    data={}; %the variables of files
+    if opts.perCF %summed per CF as they are computed
+        stats.cf=CF;
+        stats.cf_time=zeros(numel(profiles),numel(CF));
+        for p=1:numel(profiles)
+            t0=tic;
+            P=profiles(p);
+            opts.TF=P.TF;
+            mix=[P.LS(:) P.MS(:) P.HS(:)].*ones(numel(CF),3);
+            [W1,CN,IC,RcnF,RicF,T]=ICPopulation(LS,MS,HS,mix,opts);
+            stats.cf_time(p,1:numel(T))=T;
+            data{end+1}=struct('IC',IC,'CN',CN,'W1',W1);
+            data{end+1}=struct('RicF',RicF,'RcnF',RcnF);
+            stats.profile_time(p)=toc(t0);
+        end
+    else %all profiles at once, using the linearity of the CN/IC stage
+        %(there is no per-CF work, the profiles share the time)
+        t0=tic;
+        [W1s,CNs,ICs]=ICScenarios(LS,MS,HS,profiles,opts);
+        stats.profile_time(:)=toc(t0)/numel(profiles);
+        for p=1:numel(profiles)
+            data{end+1}=struct('IC',ICs(:,p),'CN',CNs(:,p),'W1',W1s(:,p));
+        end
+    end
+    toc
+    stats.wall_time=toc(tstart);
+    AsyncWrite(@SaveResults,files,data,opts.compress,'ic',ickey,statsfile,stats)
 
-end %end of all levels
\ No newline at end of file
+end %end of all levels
+AsyncWrite() %wait for the files of the last levels
@@ -0,0 +1,86 @@
+function [W1,CN,IC,RcnF,RicF,T]=ICPopulation(LS,MS,HS,mix,opts)
+% ICPopulation - streaming W1/CN/IC population response of the AN output
+%
+% Usage: [W1,CN,IC] = ICPopulation(LS,MS,HS,mix,opts)
+%        [W1,CN,IC,RcnF,RicF] = ICPopulation(LS,MS,HS,mix,opts)
+%        [W1,CN,IC,RcnF,RicF,T] = ICPopulation(LS,MS,HS,mix,opts)
+%
+% LS,MS,HS = AN rates [time x CF] of the low, medium and high spont fibers
+%            at 100 kHz, as saved by ANClick
+% mix      = [CF x 3] number of LS, MS and HS fibers synapsing onto every CN
+%            unit (the AN input of a CF is mix*[LS;MS;HS]/opts.TF)
+% opts.TF        = normalisation of the fiber mix (default 19)
+% opts.cfIdx     = CF indices summed into the population responses
+%                  (default 1:433, i.e. all CFs down to 175 Hz)
+% opts.cfWeights = weight of every CF in cfIdx (default 1)
+%
+% W1,CN,IC  = population responses at 20 kHz
+% RcnF,RicF = per-CF CN and IC responses [CF x time]
+% T         = seconds spent on every CF [1 x CF]
+%
+% Every CF is added to W1, CN and IC as soon as its CN/IC response is
+% computed, so the population responses take O(time) memory. The per-CF
+% responses are only kept when RcnF/RicF are requested, in which case all
+% CFs are computed (also the ones outside cfIdx).
+
+if nargin<5
+    opts=struct;
+end
+nCF=size(HS,2);
+if ~isfield(opts,'TF')
+    opts.TF=19;
+end
+if ~isfield(opts,'cfIdx')
+    opts.cfIdx=1:min(433,nCF);
+end
+if ~isfield(opts,'cfWeights')
+    opts.cfWeights=1;
+end
+w=zeros(1,nCF);
+w(opts.cfIdx)=opts.cfWeights;
+
+perCF=nargout>3;
+if perCF
+    todo=1:nCF;
+else
+    todo=find(w~=0);
+end
+
+FS=20000;
+W1=0; CN=0; IC=0;
+K=[];
+RcnF=[]; RicF=[];
+T=zeros(1,nCF);
+for n=todo
+    t0=tic;
+    %sampling rate down to 20kHz
+    ANHS=resample(HS(:,n),1,5);
+    ANMS=resample(MS(:,n),1,5);
+    ANLS=resample(LS(:,n),1,5);
+    if isempty(K) %same kernels for all CFs
+        K=CNICKernels(size(ANHS,1),FS);
+    end
+
+    AN=(mix(n,1)*ANLS+mix(n,3)*ANHS+mix(n,2)*ANMS)/opts.TF;
+
+    Rcn=K.Acn*(conv(K.ex,AN)-conv(K.Inhcn,circshift(AN,K.Dcn)));
+    Ric=K.Aic*(conv(K.ex,Rcn)-conv(K.Inhic,circshift(Rcn,K.Dic)));
+
+    %population responses
+    N=numel(AN);
+    if w(n)~=0
+        W1=W1+w(n)*AN(1:N); %add them up one by one
+        CN=CN+w(n)*Rcn(1:N);
+        IC=IC+w(n)*Ric(1:N);
+    end
+
+    if perCF
+        if isempty(RicF)
+            RicF=zeros(nCF,N);
+            RcnF=zeros(nCF,N);
+        end
+        RicF(n,:)=Ric(1:N);
+        RcnF(n,:)=Rcn(1:N);
+    end
+    T(n)=toc(t0);
+end
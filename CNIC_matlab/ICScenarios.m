@@ -0,0 +1,65 @@
+function [W1,CN,IC]=ICScenarios(LS,MS,HS,profiles,opts)
+% ICScenarios - W1/CN/IC population responses for many synaptopathy profiles
+%
+% Usage: [W1,CN,IC] = ICScenarios(LS,MS,HS,profiles,opts)
+%
+% LS,MS,HS = AN rates [time x CF] of the low, medium and high spont fibers
+%            at 100 kHz, as saved by ANClick
+% profiles = struct array of synaptopathy profiles with the per-CF fiber
+%            counts LS, MS, HS (scalar or 1 x CF) and their normalisation
+%            TF, e.g. [NeuroProfile(CF,1) NeuroProfile(CF,3)]
+% opts.cfIdx, opts.cfWeights = CFs of the population responses, as in
+%            ICPopulation
+%
+% W1,CN,IC = population responses at 20 kHz [time x profile]
+%
+% The resampling and the CN/IC filters are linear in the AN input, so the
+% population response of a profile is the CN/IC response of the weighted
+% sum of the AN rates over CF and fiber type. That sum is one matrix
+% product per fiber type for all profiles together, after which every
+% profile needs a single resample and CN/IC filtering instead of one per
+% CF. All profiles together cost about as much as one ICPopulation run.
+
+if nargin<5
+    opts=struct;
+end
+nCF=size(HS,2);
+if ~isfield(opts,'cfIdx')
+    opts.cfIdx=1:min(433,nCF);
+end
+if ~isfield(opts,'cfWeights')
+    opts.cfWeights=1;
+end
+w=zeros(1,nCF);
+w(opts.cfIdx)=opts.cfWeights;
+cols=find(w~=0);
+
+%% per-CF weight of every fiber type in every profile [CF x profile]
+nP=numel(profiles);
+CLS=zeros(numel(cols),nP);
+CMS=zeros(numel(cols),nP);
+CHS=zeros(numel(cols),nP);
+for p=1:nP
+    cLS=profiles(p).LS.*ones(1,nCF);
+    cMS=profiles(p).MS.*ones(1,nCF);
+    cHS=profiles(p).HS.*ones(1,nCF);
+    CLS(:,p)=w(cols).*cLS(cols)/profiles(p).TF;
+    CMS(:,p)=w(cols).*cMS(cols)/profiles(p).TF;
+    CHS(:,p)=w(cols).*cHS(cols)/profiles(p).TF;
+end
+
+%% summed AN input of every profile, then down to 20kHz
+AN=LS(:,cols)*CLS+MS(:,cols)*CMS+HS(:,cols)*CHS;
+W1=resample(AN,1,5);
+
+FS=20000;
+N=size(W1,1);
+K=CNICKernels(N,FS);
+CN=zeros(N,nP);
+IC=zeros(N,nP);
+for p=1:nP
+    Rcn=K.Acn*(conv(K.ex,W1(:,p))-conv(K.Inhcn,circshift(W1(:,p),K.Dcn)));
+    Ric=K.Aic*(conv(K.ex,Rcn)-conv(K.Inhic,circshift(Rcn,K.Dic)));
+    CN(:,p)=Rcn(1:N);
+    IC(:,p)=Ric(1:N);
+end
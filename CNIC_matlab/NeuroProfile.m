@@ -0,0 +1,68 @@
+function P=NeuroProfile(CF,Neuro)
+% NeuroProfile - synaptopathy profile of one of the ICClicks Neuro settings
+%
+% Usage: P = NeuroProfile(CF,Neuro)
+%
+% CF    = characteristic frequencies of the AN fibers in Hz
+% Neuro = 1: HS fibers only, 2: half of the HS fibers, 3: HF neuropathy,
+%         4: LF neuropathy, otherwise the normal LS/MS/HS mix
+%
+% P     = struct with the per-CF number of LS, MS and HS fibers synapsing
+%         onto a CN unit (P.LS, P.MS, P.HS), their normalisation P.TF and
+%         the file suffix P.name. Profiles can be combined in a struct array
+%         and passed to ICScenarios.
+
+Ncut=find(CF>1000,1,'last'); %indices below this boundary have HF neuropathy
+
+TF=20; %total no of fibers synapsing onto CN
+if Neuro==1
+    rLS=0;%round(15/100*TF); %in percentage of total population
+    rMS=0;%round(20/100*TF)-1;
+    rHS=round(65/100*TF);
+elseif Neuro==2
+    rLS=0;%round(15/100*TF); %in percentage of total population
+    rMS=0;%round(20/100*TF)-1;
+    rHS=round(round(65/100*TF)/2);
+elseif Neuro==3 || 4  %freq specific neuropathy
+    rLSN=0;
+    rMSN=0;
+    rHSN=0;
+    rLS=round(15/100*TF); %in percentage of total population
+    rMS=round(20/100*TF)-1;
+    rHS=round(65/100*TF);
+else
+    rLS=round(15/100*TF); %in percentage of total population
+    rMS=round(20/100*TF)-1;
+    rHS=round(65/100*TF);
+end
+TFtot=19;
+%ratios for LS/HS in pct
+
+P.LS=rLS*ones(1,numel(CF));
+P.MS=rMS*ones(1,numel(CF));
+P.HS=rHS*ones(1,numel(CF));
+if Neuro==3 %for the neuropathy region HF
+    N=CF>Ncut;
+elseif Neuro==4 %for the neuropathy region LF
+    N=CF<Ncut;
+else
+    N=false(1,numel(CF));
+end
+if any(N)
+    P.LS(N)=rLSN;
+    P.MS(N)=rMSN;
+    P.HS(N)=rHSN;
+end
+P.TF=TFtot;
+
+if Neuro==1
+    P.name='_HS';
+elseif Neuro==2
+    P.name='_HS50';
+elseif Neuro==3
+    P.name='_HSHF';
+elseif Neuro==4
+    P.name='_HSLF';
+else
+    P.name='_Mix';
+end
@@ -0,0 +1,58 @@
+function err=PrecisionReport(refdir,testdir,L,profile,name)
+% PrecisionReport - AN rate and IC waveform errors of a run against a reference
+%
+% Usage: err = PrecisionReport(refdir,testdir,L,profile,name)
+%
+% refdir,testdir = directories with the AN (ANClick) and IC (ICClicks)
+%                  files of the same stimulus, e.g. of the float64 and
+%                  storage32 outputs of Cochlea/precision_report.py, the AN
+%                  files of both made with the same seed argument of ANClick
+% L              = levels of the files
+% profile        = file suffix of the synaptopathy profile (NeuroProfile
+%                  name), default the profile of Neuro=1
+% name           = file prefix, default 'TH_'
+%
+% err = struct with per level the maximum errors of the LS, MS and HS rates,
+%       the IC and the CN waveform, relative to the maximum of the
+%       reference, which are also printed.
+%
+% The AN model draws ffGn noise and spikes, unseeded runs differ by far more
+% than the precision of the cochlea, so the report refuses AN files whose
+% stats sidecars (TH_AN_<L>.stats.json) do not hold the same seed.
+
+if nargin<4
+    load CFs.mat
+    P=NeuroProfile(CF,1);
+    profile=P.name;
+end
+if nargin<5
+    name='TH_';
+end
+fields={'LS','MS','HS','IC','CN'};
+for f=1:numel(fields)
+    err.(fields{f})=zeros(size(L));
+end
+fprintf('%6s %10s %10s %10s %10s %10s\n','level','LS','MS','HS','IC','CN');
+for k=1:numel(L)
+    file=[name,'AN_',num2str(L(k)),'.stats.json'];
+    ref=jsondecode(fileread(fullfile(refdir,file)));
+    test=jsondecode(fileread(fullfile(testdir,file)));
+    if ~isfield(ref,'seed') || isempty(ref.seed) || ~isfield(test,'seed') || ~isequal(ref.seed,test.seed)
+        error('PrecisionReport:seed','%s: the AN runs of both directories need the same seed (ANClick seed argument)',file)
+    end
+    for f=1:numel(fields)
+        if f<=3
+            file=[name,'AN',fields{f},'_',num2str(L(k)),'.mat'];
+        else
+            file=['IC',name,num2str(L(k)),profile,'.mat'];
+        end
+        ref=load(fullfile(refdir,file),fields{f});
+        test=load(fullfile(testdir,file),fields{f});
+        ref=double(ref.(fields{f}));
+        test=double(test.(fields{f}));
+        %the AN model leaves the rates of the CFs below 80 Hz NaN
+        d=abs(test-ref);
+        err.(fields{f})(k)=max(d(~isnan(d)))/max(abs(ref(~isnan(ref))));
+    end
+    fprintf('%6g %10.2e %10.2e %10.2e %10.2e %10.2e\n',L(k),err.LS(k),err.MS(k),err.HS(k),err.IC(k),err.CN(k));
+end
@@ -5,12 +5,8 @@ Fs=100000;
 type='NH';
 
 name=[type,'ClicksMEL'];
-%move the correct poles to the execution folder
-if type=='HI'
-    copyfile('../sysfiles/HIPoles/StartingPoles.dat','../sysfiles')
-elseif type=='NH'
-    copyfile('../sysfiles/NHPoles/StartingPoles.dat','../sysfiles')
-end
+%poles profile of the model, read by run_cochlear_model.py
+poles=['../sysfiles/',type,'Poles/StartingPoles.dat'];
 
 % Model params
 channels = 11;    %stimulus blocks
@@ -28,8 +24,8 @@ for k=1:channels
     stim(k,:)=2*sqrt(2)*SC; 
 end
 
-save('input.mat','stim','Fs','spl','channels','normalizeRMS','subject','irregularities','sheraPo','probes')
-system('python run_cochlear_modelold.py')   
+save('input.mat','stim','Fs','spl','channels','normalizeRMS','subject','irregularities','sheraPo','probes','poles')
+system('python run_cochlear_model.py')   
 %movefile('output.mat',['./out/Clicks/',name,'.mat'])
 
 break
@@ -0,0 +1,80 @@
+# -*- coding: utf-8 -*-
+# bounded asynchronous write queue with its own I/O thread
+#
+# The writes of a run (savemat of output.mat, the stats sidecar, the copy
+# into the stage cache) are queued and done one after the other by a single
+# thread, so the caller can start the next job while the last one is
+# flushed. The queue holds at most maxsize writes, submit blocks while it is
+# full, so the memory of the waiting results stays bounded.
+import threading
+import traceback
+try:
+    import queue
+except ImportError:  # python 2
+    import Queue as queue
+
+
+class Write(object):
+    """handle of a queued write"""
+
+    def __init__(self):
+        self.event = threading.Event()
+        self.result = None
+        self.error = None
+
+    def wait(self):
+        """result of the write, its exception is raised here"""
+        self.event.wait()
+        if self.error is not None:
+            raise self.error
+        return self.result
+
+
+class AsyncWriter(object):
+
+    def __init__(self, maxsize=4):
+        self.queue = queue.Queue(maxsize)
+        # errors of the writes not yet taken by pop_error
+        self.errors = []
+        self.thread = threading.Thread(target=self._run)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def _run(self):
+        while True:
+            item = self.queue.get()
+            if item is None:
+                self.queue.task_done()
+                return
+            fn, args, write = item
+            try:
+                write.result = fn(*args)
+            except Exception as e:
+                traceback.print_exc()
+                write.error = e
+                self.errors.append(e)
+            write.event.set()
+            self.queue.task_done()
+
+    def submit(self, fn, *args):
+        """queue fn(*args), after all writes submitted before"""
+        write = Write()
+        self.queue.put((fn, args, write))
+        return write
+
+    def pop_error(self):
+        """first error since the last call, or None"""
+        errors, self.errors = self.errors, []
+        return errors[0] if errors else None
+
+    def flush(self):
+        """wait for all queued writes, raises the first error"""
+        self.queue.join()
+        error = self.pop_error()
+        if error is not None:
+            raise error
+
+    def close(self):
+        self.flush()
+        self.queue.put(None)
+        self.thread.join()
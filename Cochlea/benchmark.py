@@ -0,0 +1,345 @@
+# -*- coding: utf-8 -*-
+# micro and end-to-end benchmarks of the cochlea stage
+#
+# usage: python benchmark.py [-k name] [-o result.json] [-b baseline.json]
+#        python benchmark.py -T threads [-s sections] [-o result.json]
+#        python benchmark.py --compare result.json baseline.json
+#
+# The micro benchmarks time the hot kernels of one cochlea in isolation, on
+# a model of the Clicks.m setup and inputs drawn with a fixed seed:
+#   tl_rhs             TLsolver, one right hand side evaluation of dopri5
+#   imex_step          one sample of the imex integrator (IMEXSubsteps)
+#   solve_tridiagonal  the tridiagonal solve of TLsolver
+#   delay_line         the Zweig delay line interpolation
+#   nonlinearity       knee_poles, SheraParameters and ZweigImpedance,
+#                      the pole update of the velocity non-linearity
+# The end-to-end benchmarks run run_cochlea on the stimuli of Clicks.m
+# (clicks, 11 levels) and sarahInput.m (sarah, a 60 dB 1 kHz tone pair),
+# each repeat with an empty cache, on -j processes placed on the NUMA nodes
+# by -p (numa_placement.py), e.g. the cost of unplaced workers on a
+# dual-socket node:
+#   python benchmark.py -k clicks -j 16 -p none -o none.json
+#   python benchmark.py -k clicks -j 16 -p node -b none.json
+# The MATLAB stages (IHC, Synapse, SpikeGenerator, CN/IC) are timed by
+# sysfiles/Benchmark.m, which writes the same format.
+#
+# -T 1,2,4,8 sweeps the threads of one cochlea (Threads) instead, at
+# ModelSections 1000 and 4000 (-s): solve_tridiagonal_mt, the whole right
+# hand side (tl_rhs, alternating between two states so that every call also
+# updates the poles) and the solve of the first SWEEP_TIME of the 100 dB
+# click, named <benchmark>/n<sections>/t<threads>, with the speedup against
+# the first thread count:
+#   python benchmark.py -T 1,2,4,8 -o threads.json
+#
+# The results (seconds per call, min and median over the repeats) are
+# written as JSON with -o. Against a baseline (-b, or --compare for two
+# result files) every benchmark slower than the baseline median by more
+# than the tolerance is reported as a regression, and the exit status is 1.
+import argparse
+import itertools
+import json
+import multiprocessing as mp
+import os
+import platform
+import shutil
+import sys
+import tempfile
+import time
+# the end-to-end runs start from an empty cache, set before the model
+# modules read it
+CACHE = tempfile.mkdtemp(prefix='abrbench')
+os.environ['ABR_CACHE'] = CACHE
+import numpy as np
+import cochlear_model
+import model_snapshot
+import numa_placement
+import run_cochlear_model
+
+Fs = 100000.
+SEED = 1
+here = os.path.dirname(os.path.abspath(__file__))
+NH = os.path.join(here, '..', 'sysfiles', 'NHPoles', 'StartingPoles.dat')
+DEFAULT = os.path.join(here, '..', 'sysfiles', 'StartingPoles.dat')
+SWEEP_SECTIONS = [1000, 4000]
+# seconds of the click solved per point of the threads sweep
+SWEEP_TIME = 5e-3
+
+
+def clicks():
+    """run of Clicks.m"""
+    stim = np.zeros(round(Fs * 1e-3) + round(80e-6 * Fs) + round(Fs * 50e-3))
+    stim[round(Fs * 1e-3):round(Fs * 1e-3) + round(80e-6 * Fs)] = 1
+    spl = np.arange(0, 101, 10)
+    return run_cochlear_model.make_run(
+        np.tile(2 * np.sqrt(2) * stim, (len(spl), 1)), Fs, spl, 1,
+        np.ones(len(spl)), np.loadtxt(NH, delimiter=','))
+
+
+def sarah():
+    """run of sarahInput.m, with a raised cosine for its onset window"""
+    t = np.arange(round(250e-3 * Fs)) / Fs
+    ramp = np.ones(len(t))
+    on = int(round(10e-3 * Fs))
+    ramp[0:on] = 0.5 - 0.5 * np.cos(np.pi * np.arange(on) / on)
+    ramp[len(t) - on:] = ramp[on - 1::-1]
+    tone = 0.999 * np.sin(2 * np.pi * 1000. * t) * ramp
+    tone = np.sqrt(2) * tone / np.sqrt(np.mean(tone ** 2))
+    stim = np.concatenate([tone, np.zeros(round(200e-3 * Fs)), tone,
+                           np.zeros(round(100e-3 * Fs))])
+    return run_cochlear_model.make_run(stim, Fs, [60], 1, [1],
+                                       np.loadtxt(DEFAULT, delimiter=','))
+
+
+def model(run):
+    """model of the first channel of a run, ready to solve"""
+    coch = model_snapshot.load_model(run_cochlear_model.model_params(
+        run, run['irregularities'][0]))
+    coch.threads = run_cochlear_model.Threads
+    coch.init_stimulus(run['stim'][0])
+    return coch
+
+
+def micro_benchmarks():
+    """name and setup of every micro benchmark, the setup returns the
+    callable to time"""
+    rng = np.random.RandomState(SEED)
+
+    def tl_rhs():
+        coch = model(clicks())
+        y = np.concatenate([1e-9 * rng.standard_normal(coch.n + 1),
+                            1e-12 * rng.standard_normal(coch.n + 1)])
+        return lambda: cochlear_model.TLsolver(0.5 * coch.dt, y, coch)
+
+    def imex_step():
+        coch = model(clicks())
+        coch.initIMEX()
+        V = 1e-9 * rng.standard_normal(coch.n + 1)
+        Y = 1e-12 * rng.standard_normal(coch.n + 1)
+        return lambda: coch.imex_step(V, Y, run_cochlear_model.IMEXSubsteps)
+
+    def solve_tridiagonal():
+        coch = model(clicks())
+        coch.right[:] = rng.standard_normal(coch.n + 1)
+        return lambda: cochlear_model.solve_tridiagonal(
+            coch, coch.tridata, coch.r_pointer, coch.Qpointer)
+
+    def delay_line():
+        coch = model(clicks())
+        coch.Ybuffer[:] = rng.standard_normal(coch.Ybuffer.shape)
+        return lambda: cochlear_model.delay_line(coch, 0.5)
+
+    def nonlinearity():
+        coch = model(clicks())
+        V = 1e-4 * rng.standard_normal(coch.n + 1)
+
+        def update():
+            coch.SheraP[:] = cochlear_model.knee_poles(coch, V)
+            coch.SheraParameters()
+            coch.ZweigImpedance()
+        return update
+    return [('tl_rhs', tl_rhs), ('imex_step', imex_step),
+            ('solve_tridiagonal', solve_tridiagonal),
+            ('delay_line', delay_line), ('nonlinearity', nonlinearity)]
+
+
+def thread_benchmarks(threads, sections):
+    """the threaded kernels and the solve of one cochlea at every number of
+    model sections and threads"""
+    rng = np.random.RandomState(SEED)
+
+    def sweep_model(n, t):
+        model_sections = run_cochlear_model.ModelSections
+        run_cochlear_model.ModelSections = n
+        try:
+            run = clicks()
+            coch = model_snapshot.load_model(run_cochlear_model.model_params(
+                run, run['irregularities'][0]))
+        finally:
+            run_cochlear_model.ModelSections = model_sections
+        coch.threads = t
+        # the 100 dB click
+        coch.init_stimulus(run['stim'][-1][0:int(SWEEP_TIME * Fs)])
+        return coch
+
+    def solve_tridiagonal_mt(n, t):
+        coch = sweep_model(n, t)
+        coch.right[:] = rng.standard_normal(coch.n + 1)
+        return lambda: cochlear_model.libtrisolv.solve_tridiagonal_mt(
+            cochlear_model.ctypes.byref(coch.tridata), coch.r_pointer,
+            coch.Qpointer, coch.n + 1, t)
+
+    def tl_rhs(n, t):
+        coch = sweep_model(n, t)
+        coch.Ybuffer[:] = 1e-7 * rng.standard_normal(coch.Ybuffer.shape)
+        ys = [np.concatenate([1e-4 * rng.standard_normal(coch.n + 1),
+                              1e-7 * rng.standard_normal(coch.n + 1)])
+              for k in range(2)]
+        calls = itertools.count()
+        return lambda: cochlear_model.TLsolver(
+            0.5 * coch.dt, ys[next(calls) % 2], coch)
+
+    def solve(n, t):
+        coch = sweep_model(n, t)
+
+        def run():
+            coch.initState()
+            coch.solve(run_cochlear_model.Integrator,
+                       run_cochlear_model.IMEXSubsteps)
+        return run
+    return [('%s/n%d/t%d' % (k.__name__, n, t),
+             lambda k=k, n=n, t=t: k(n, t), k != solve)
+            for k in (solve_tridiagonal_mt, tl_rhs, solve)
+            for n in sections for t in threads]
+
+
+def speedups(result, threads):
+    """print the speedup of every sweep point against the first thread
+    count"""
+    print("%-34s %8s" % ('benchmark', 'speedup'))
+    for name, b in sorted(result['benchmarks'].items()):
+        base = name.rsplit('/', 1)[0] + '/t%d' % threads[0]
+        if base in result['benchmarks']:
+            print("%-34s %8.2f" % (
+                name, result['benchmarks'][base]['median'] / b['median']))
+
+
+def end_to_end_benchmarks(processes):
+    def setup(make):
+        run = make()
+        output = os.path.join(CACHE, 'output.mat')
+
+        def solve():
+            # every repeat from an empty cache
+            for d in os.listdir(CACHE):
+                if os.path.isdir(os.path.join(CACHE, d)):
+                    shutil.rmtree(os.path.join(CACHE, d))
+            run_cochlear_model.run_cochlea(run, output, processes)
+        return solve
+    return [('clicks', lambda: setup(clicks)),
+            ('sarah', lambda: setup(sarah))]
+
+
+def measure(f, repeats, min_time=0.):
+    """seconds per call of f, with min_time the calls are batched to at
+    least min_time per repeat, after a first call for warm up"""
+    number = 1
+    if min_time > 0:
+        start = time.time()
+        f()
+        elapsed = time.time() - start
+        number = max(1, int(min_time / max(elapsed, 1e-7)))
+    times = []
+    for r in range(repeats):
+        start = time.time()
+        for i in range(number):
+            f()
+        times.append((time.time() - start) / number)
+    return {'min': min(times), 'median': float(np.median(times)),
+            'repeats': repeats, 'number': number}
+
+
+def machine():
+    return {'platform': platform.platform(), 'processor':
+            platform.processor(), 'cpus': mp.cpu_count(), 'python':
+            platform.python_version(), 'numpy': np.__version__,
+            'integrator': run_cochlear_model.Integrator,
+            'threads': run_cochlear_model.Threads,
+            'placement': run_cochlear_model.Placement,
+            'numa_nodes': len(numa_placement.nodes())}
+
+
+def compare(result, baseline, tolerance):
+    """print the benchmarks of result against baseline, returns the names
+    of the regressions"""
+    regressions = []
+    print("%-18s %12s %12s %8s" % ('benchmark', 'median[s]', 'baseline[s]',
+                                    'ratio'))
+    for name, b in sorted(result['benchmarks'].items()):
+        if name not in baseline['benchmarks']:
+            print("%-18s %12.4g %12s %8s" % (name, b['median'], '-', '-'))
+            continue
+        ratio = b['median'] / baseline['benchmarks'][name]['median']
+        flag = ''
+        if ratio > 1 + tolerance:
+            regressions.append(name)
+            flag = ' REGRESSION'
+        print("%-18s %12.4g %12.4g %8.2f%s" % (
+            name, b['median'], baseline['benchmarks'][name]['median'],
+            ratio, flag))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="benchmarks of the cochlea stage")
+    parser.add_argument('-k', dest='only', action='append',
+                        help="run only the benchmarks with this in the name")
+    parser.add_argument('-r', dest='repeats', type=int, default=5,
+                        help="repeats of the micro benchmarks")
+    parser.add_argument('-R', dest='end_to_end_repeats', type=int,
+                        default=1, help="repeats of the end-to-end runs")
+    parser.add_argument('-j', dest='processes', type=int, default=0,
+                        help="processes of the end-to-end runs, 0: serial")
+    parser.add_argument('-p', dest='placement',
+                        choices=numa_placement.POLICIES,
+                        help="placement of the processes of the end-to-end "
+                        "runs (default ABR_PLACEMENT or none)")
+    parser.add_argument('-T', dest='threads',
+                        help="threads sweep, comma separated thread counts")
+    parser.add_argument('-s', dest='sections',
+                        default=','.join(map(str, SWEEP_SECTIONS)),
+                        help="model sections of the threads sweep")
+    parser.add_argument('-o', dest='output', help="write the result here")
+    parser.add_argument('-b', dest='baseline', help="baseline result")
+    parser.add_argument('-t', dest='tolerance', type=float, default=0.1,
+                        help="allowed slowdown against the baseline")
+    parser.add_argument('--compare', nargs=2, metavar=('RESULT', 'BASELINE'),
+                        help="only compare two result files")
+    args = parser.parse_args()
+    if args.compare:
+        with open(args.compare[0]) as f:
+            result = json.load(f)
+        with open(args.compare[1]) as f:
+            baseline = json.load(f)
+        return 1 if compare(result, baseline, args.tolerance) else 0
+
+    if args.placement:
+        run_cochlear_model.Placement = args.placement
+    result = {'machine': machine(), 'benchmarks': {}}
+    if args.threads:
+        threads = [int(t) for t in args.threads.split(',')]
+        result['machine']['sweep_time'] = SWEEP_TIME
+        benchmarks = [(n, s, args.repeats if micro else
+                       args.end_to_end_repeats, 0.2 if micro else 0.)
+                      for n, s, micro in thread_benchmarks(
+                          threads, [int(n) for n in
+                                    args.sections.split(',')])]
+    else:
+        benchmarks = [(n, s, args.repeats, 0.2)
+                      for n, s in micro_benchmarks()] + \
+            [(n, s, args.end_to_end_repeats, 0.)
+             for n, s in end_to_end_benchmarks(args.processes)]
+    for name, setup, repeats, min_time in benchmarks:
+        if args.only and not any(k in name for k in args.only):
+            continue
+        result['benchmarks'][name] = measure(setup(), repeats, min_time)
+        print("%-18s %12.4g s" % (name, result['benchmarks'][name]['median']))
+        sys.stdout.flush()
+    if args.threads:
+        speedups(result, threads)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(result, f, indent=1, sort_keys=True)
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        return 1 if compare(result, baseline, args.tolerance) else 0
+    return 0
+
+
+if __name__ == "__main__":
+    try:
+        status = main()
+    finally:
+        shutil.rmtree(CACHE)
+    sys.exit(status)
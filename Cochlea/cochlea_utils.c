@@ -1,7 +1,12 @@
+/* build: gcc -O3 -fPIC -shared -fopenmp cochlea_utils.c -o tridiag.so
+   (without -fopenmp the _mt functions run on one thread) */
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #define PI 3.14159265358979323846
 typedef struct tridiag_matrix{
 	double *a;
@@ -60,3 +65,315 @@ void calculate_g(double *V,double *Y,double *sherad_factor,double *sheraD,double
 		g[i]=sherad_factor[i]*sheraD[i]*V[i]+omega[i]*omega[i]*(Y[i]+sheraRho[i]*Yzweig[i]);
 	}
 }
+
+/* block k of P of the partitioned (SPIKE) version of solve_tridiagonal,
+   called by all P threads of a parallel region: every thread solves its
+   block of rows with the couplings to the neighbouring blocks as two extra
+   right hand sides (v and w), the block boundaries are then a small 2x2
+   block tridiagonal system, after which every thread corrects its block.
+   cprime holds 3*N+8*P doubles of scratch. The matrix must be diagonally
+   dominant (as the TL matrix is), there is no pivoting. */
+static void spike_block(Tridiag_M *t, double *r,double *x,int N,int k,int P,double *cprime) {
+    int in;
+    double *v=cprime+N;
+    double *w=v+N;
+    /* boundary values of the blocks, then the solution at the boundaries */
+    double *ys=w+N;
+    double *ye=ys+P,*vs=ye+P,*ve=vs+P,*ws=ve+P,*we=ws+P,*Xs=we+P,*Xe=Xs+P;
+    int s=(int)((long)N*k/P);
+    int e=(int)((long)N*(k+1)/P)-1;
+    double m=1.0/t->b[s];
+    cprime[s]=t->c[s]*m;
+    x[s]=r[s]*m;
+    v[s]=(k>0 ? t->a[s] : 0.)*m;
+    for(in=s+1;in<=e;in++){
+        m=1.0/(t->b[in]-t->a[in]*cprime[in-1]);
+        cprime[in]=t->c[in]*m;
+        x[in]=(r[in]-t->a[in]*x[in-1])*m;
+        v[in]=-t->a[in]*v[in-1]*m;
+    }
+    w[e]=(k<P-1 ? t->c[e] : 0.)*m;
+    for(in=e;in-- >s; ){
+        x[in]=x[in]-cprime[in]*x[in+1];
+        v[in]=v[in]-cprime[in]*v[in+1];
+        w[in]=-cprime[in]*w[in+1];
+    }
+    ys[k]=x[s];ye[k]=x[e];
+    vs[k]=v[s];ve[k]=v[e];
+    ws[k]=w[s];we[k]=w[e];
+    #pragma omp barrier
+    #pragma omp single
+    {
+        /* unknowns of interface j: (x at the end of block j, x at the
+           start of block j+1), the sub and super diagonal blocks only
+           have one element each (ve[j] and ws[j+1]) */
+        int j;
+        double *c0=(double*) malloc(4*P*sizeof(double));
+        double *c1=c0+P,*d0=c1+P,*d1=d0+P;
+        for(j=0;j<P-1;j++){
+            double b00=1.,b01=we[j],b10=vs[j+1],b11=1.;
+            double r0=ye[j],r1=ys[j+1];
+            if(j>0){
+                b01-=ve[j]*c0[j-1];
+                r0-=ve[j]*d0[j-1];
+            }
+            double det=1.0/(b00*b11-b01*b10);
+            double s1=(j<P-2 ? ws[j+1] : 0.);
+            c0[j]=-b01*s1*det;
+            c1[j]=b00*s1*det;
+            d0[j]=(b11*r0-b01*r1)*det;
+            d1[j]=(b00*r1-b10*r0)*det;
+        }
+        for(j=P-1;j-- >0; ){
+            Xe[j]=d0[j];
+            Xs[j+1]=d1[j];
+            if(j<P-2){
+                Xe[j]-=c0[j]*Xs[j+2];
+                Xs[j+1]-=c1[j]*Xs[j+2];
+            }
+        }
+        free(c0);
+    }
+    double left=(k>0 ? Xe[k-1] : 0.);
+    double right=(k<P-1 ? Xs[k+1] : 0.);
+    for(in=s;in<=e;in++){
+        x[in]=x[in]-v[in]*left-w[in]*right;
+    }
+}
+
+/* threads of a SPIKE solve of N rows, at least 16 rows per block */
+static int spike_threads(int N,int nthreads) {
+#ifdef _OPENMP
+    if(nthreads>N/16)
+        return N/16;
+    return nthreads;
+#else
+    return 1;
+#endif
+}
+
+/* solve_tridiagonal on nthreads threads, see spike_block */
+void solve_tridiagonal_mt(Tridiag_M *t, double *r,double *x,int N,int nthreads) {
+    int P=spike_threads(N,nthreads);
+    if(P<2){
+        solve_tridiagonal(t,r,x,N);
+        return;
+    }
+    double *scratch=(double*) malloc((3*N+8*P)*sizeof(double));
+    #pragma omp parallel num_threads(P)
+    {
+        int k=0;
+#ifdef _OPENMP
+        k=omp_get_thread_num();
+#endif
+        spike_block(t,r,x,N,k,P,scratch);
+    }
+    free(scratch);
+}
+
+/* delay_line with the fractional delays dev+frac, on nthreads threads */
+void delay_line_mt(double *Y, int *delay0,int *delay1,int *delay2,int *delay3,double *dev,double frac,double *out,int M,int N,int nthreads){
+	int i;
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for(i=0;i<N;i++){
+        long k=(long)M*i;
+        out[i]=interpl_4(Y[k+delay0[i]],Y[k+delay1[i]],Y[k+delay2[i]],Y[k+delay3[i]],dev[i]+frac);
+	}
+}
+
+/* the model of TLsolver for tl_rhs, the arrays of cochlea_model (see
+   cochlea_model.init_rhs), which it updates in place */
+typedef struct tl_model{
+	int n; /* sections+1 */
+	int threads;
+	int poles; /* the non-linearity moves the poles (use_Zweig) */
+	int displacement; /* non_linearity 1, driven by Y instead of V */
+	int M; /* YbufferLgt */
+	double dt,c,d_m_factor,RK4_0,RK4G_0;
+	double *knee,*const_nl1,*Sa,*Sb,*sinTheta,*cosTheta,*PoleS,*PoleE,*Pnew;
+	double *SheraP,*SheraD,*SheraMu,*SheraRho;
+	double *omega,*omega2,*sherad_factor,*ZASQ;
+	double *Ybuffer,*dev,*Yzweig,*g,*right,*passive,*Q;
+	int *Zrp,*Zrp1,*Zrp2,*Zrp3;
+	Tridiag_M *t;
+	double *times; /* seconds of the pole update, g and the solve */
+} TL_model;
+
+static double seconds(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+1e-9*ts.tv_nsec;
+}
+
+/* TLsolver in one parallel region of m->threads threads (at least 16
+   sections each): the poles of the non-linearity (knee_poles), and if one
+   moves by more than 1% SheraParameters and ZweigImpedance of all
+   sections, then the delay line, g and the right hand side (as
+   calculate_g and calculate_right), the tridiagonal solve and the
+   derivative dy of y=(V,Y). Zwp is the newest sample of the delay line.
+   Returns the number of sections whose pole moved by more than 1% if the
+   poles were updated, else -1. */
+int tl_rhs(TL_model *m,double *y,double *dy,double frac,double p0xF0,int Zwp){
+	int n=m->n,M=m->M;
+	int P=spike_threads(n,m->threads);
+	double *V=y,*Y=y+n;
+	double maxmoved=0.,t0=seconds(),t1=t0,t2=t0;
+	int moved=0;
+	double *scratch=(P>1 ? (double*) malloc((3*n+8*P)*sizeof(double)) : NULL);
+	#pragma omp parallel num_threads(P) if(P>1)
+	{
+		int i,k=0;
+#ifdef _OPENMP
+		k=omp_get_thread_num();
+#endif
+		if(m->poles){
+			#pragma omp for schedule(static) reduction(max:maxmoved) reduction(+:moved)
+			for(i=0;i<n;i++){
+				double x=fabs(m->displacement ? Y[i] : V[i])/m->knee[i];
+				double sxp=(x-1.)*m->const_nl1[i];
+				double q=sxp/m->Sa[i];
+				double syp=m->Sb[i]*sqrt(1+q*q);
+				double p=m->PoleS[i]+(sxp*m->sinTheta[i]+syp*m->cosTheta[i])/100.;
+				m->Pnew[i]=fmin(p,m->PoleE[i]);
+				if(i>0){
+					double d=fabs(m->Pnew[i]-m->SheraP[i])/fabs(m->SheraP[i]);
+					if(d>maxmoved)
+						maxmoved=d;
+					if(d>0.01)
+						moved++;
+				}
+			}
+			if(maxmoved>0.01){
+				#pragma omp for schedule(static)
+				for(i=0;i<n;i++){
+					double p=m->Pnew[i];
+					double a=(p+sqrt(p*p+m->c*(1.0-p*p)))/m->c;
+					double d=2.0*(p-a);
+					double exact,delay,z;
+					m->SheraP[i]=p;
+					m->SheraD[i]=d;
+					m->SheraMu[i]=1./a;
+					m->SheraRho[i]=2.*a*sqrt(1.-(d/2.)*(d/2.))*exp(-p/a);
+					exact=m->SheraMu[i]/(m->omega[i]*m->dt);
+					delay=floor(exact)+1.;
+					m->dev[i]=delay-exact;
+					z=fmod((double)(Zwp+M)-delay,(double)M);
+					if(z<0)
+						z+=M;
+					m->Zrp1[i]=(int)z;
+					m->Zrp[i]=(m->Zrp1[i]+M-1)%M;
+					m->Zrp2[i]=(m->Zrp1[i]+1)%M;
+					m->Zrp3[i]=(m->Zrp2[i]+1)%M;
+				}
+			}
+		}
+		#pragma omp master
+		t1=seconds();
+		#pragma omp for schedule(static)
+		for(i=0;i<n;i++){
+			long j=(long)M*i;
+			double dtot=m->sherad_factor[i]*m->SheraD[i];
+			double yz=interpl_4(m->Ybuffer[j+m->Zrp[i]],m->Ybuffer[j+m->Zrp1[i]],m->Ybuffer[j+m->Zrp2[i]],m->Ybuffer[j+m->Zrp3[i]],m->dev[i]+frac);
+			m->Yzweig[i]=yz;
+			m->passive[i]=dtot*V[i]+m->SheraRho[i]*yz*m->omega2[i];
+			if(i==0){
+				m->g[0]=m->d_m_factor*V[0];
+				m->right[0]=m->g[0]+p0xF0;
+			}
+			else{
+				m->g[i]=dtot*V[i]+m->omega2[i]*(Y[i]+m->SheraRho[i]*yz);
+				m->right[i]=m->ZASQ[i]*m->g[i];
+			}
+		}
+		#pragma omp master
+		t2=seconds();
+		if(P>1){
+			spike_block(m->t,m->right,m->Q,n,k,P,scratch);
+			#pragma omp barrier
+		}
+		else
+			solve_tridiagonal(m->t,m->right,m->Q,n);
+		#pragma omp for schedule(static)
+		for(i=0;i<n;i++){
+			dy[i]=m->Q[i]-m->g[i];
+			dy[n+i]=V[i];
+		}
+	}
+	dy[0]=m->RK4_0*m->Q[0]+m->RK4G_0*(m->g[0]+p0xF0);
+	free(scratch);
+	m->times[0]+=t1-t0;
+	m->times[1]+=t2-t1;
+	m->times[2]+=seconds()-t2;
+	return maxmoved>0.01 ? moved : -1;
+}
+
+/* gammatone filterbank of N sections (gammatone_frontend.py), the wide band
+   gammatone of Zilany et al. (WbGammaTone): shift the input down by cf,
+   order complex bilinear low-pass stages with time constant tau, shift back
+   up and scale by gain. The complex states are kept as separate real and
+   imaginary arrays (the COMPLEX/CMULT arithmetic of
+   ANerve_matlab/complex.hpp in structure of arrays form), so all inner
+   loops run over the sections and vectorize.
+   x[M] is the input, out[M*N] the output time-major (sample k of section i
+   at out[k*N+i]). */
+void gammatone_bank(double *x,int M,double *cf,double *tau,double *gain,int order,double tdres,double *out,int N){
+	int i,j,k;
+	double *c1=(double*) malloc(N*sizeof(double));
+	double *c2=(double*) malloc(N*sizeof(double));
+	double *rr=(double*) malloc(N*sizeof(double)); /* exp(-i*2*pi*cf*tdres) */
+	double *ri=(double*) malloc(N*sizeof(double));
+	double *pr=(double*) malloc(N*sizeof(double)); /* exp(i*phase) */
+	double *pi=(double*) malloc(N*sizeof(double));
+	double *tr=(double*) malloc(N*sizeof(double)); /* old value of a stage */
+	double *ti=(double*) malloc(N*sizeof(double));
+	double *sr=(double*) calloc((order+1)*N,sizeof(double)); /* stages */
+	double *si=(double*) calloc((order+1)*N,sizeof(double));
+	for(i=0;i<N;i++){
+		double d=tau[i]*2.0/tdres;
+		c1[i]=(d-1)/(d+1);
+		c2[i]=1.0/(d+1);
+		rr[i]=cos(-2*PI*cf[i]*tdres);
+		ri[i]=sin(-2*PI*cf[i]*tdres);
+		pr[i]=1.;
+		pi[i]=0.;
+	}
+	for(k=0;k<M;k++){
+		double *o=out+(long)k*N;
+		for(i=0;i<N;i++){
+			double t=pr[i]*rr[i]-pi[i]*ri[i];
+			pi[i]=pi[i]*rr[i]+pr[i]*ri[i];
+			pr[i]=t;
+		}
+		/* against the rounding drift of the repeated rotation */
+		if((k&1023)==1023){
+			for(i=0;i<N;i++){
+				double m=1./sqrt(pr[i]*pr[i]+pi[i]*pi[i]);
+				pr[i]*=m;
+				pi[i]*=m;
+			}
+		}
+		/* stage 0: the input shifted down */
+		for(i=0;i<N;i++){
+			tr[i]=sr[i];
+			ti[i]=si[i];
+			sr[i]=x[k]*pr[i];
+			si[i]=x[k]*pi[i];
+		}
+		/* stage j from the new and the old stage j-1 and the old stage j */
+		for(j=1;j<=order;j++){
+			double *ar=sr+j*N,*ai=si+j*N,*br=sr+(j-1)*N,*bi=si+(j-1)*N;
+			for(i=0;i<N;i++){
+				double t=ar[i],u=ai[i];
+				ar[i]=c2[i]*(br[i]+tr[i])+c1[i]*t;
+				ai[i]=c2[i]*(bi[i]+ti[i])+c1[i]*u;
+				tr[i]=t;
+				ti[i]=u;
+			}
+		}
+		/* shifted back up, the real part */
+		for(i=0;i<N;i++){
+			o[i]=gain[i]*(sr[order*N+i]*pr[i]+si[order*N+i]*pi[i]);
+		}
+	}
+	free(c1); free(c2); free(rr); free(ri); free(pr); free(pi); free(tr); free(ti); free(sr); free(si);
+}
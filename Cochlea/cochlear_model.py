@@ -4,7 +4,14 @@ import time
 from scipy.integrate import ode
 from scipy import signal
 import ctypes
+import hashlib
+import json
 import os
+import sys
+try:
+    import resource
+except ImportError:  # not on windows
+    resource = None
 
 DOUBLE = ctypes.c_double
 INT = ctypes.c_int
@@ -43,60 +50,190 @@ libtrisolv.delay_line.argtypes = [PDOUBLE,  # in_matrix
                                   INT  # n
                                   ]
 
-# definition of the function
+# threaded kernels of the imex integrator, used if cochlea_model.threads > 1
+VECTOR = np.ctypeslib.ndpointer(dtype=np.float64, flags='C_CONTIGUOUS')
+libtrisolv.solve_tridiagonal_mt.restype = None
+libtrisolv.solve_tridiagonal_mt.argtypes = [ctypes.POINTER(tridiag_matrix),
+                                            PDOUBLE, PDOUBLE, INT,
+                                            INT  # threads
+                                            ]
+libtrisolv.delay_line_mt.restype = None
+libtrisolv.delay_line_mt.argtypes = [PDOUBLE, PINT, PINT, PINT, PINT,
+                                     PDOUBLE,  # dev
+                                     DOUBLE,  # frac, added to dev
+                                     PDOUBLE, INT, INT,
+                                     INT  # threads
+                                     ]
+
+
+# the arrays and constants of a model for tl_rhs, set by
+# cochlea_model.init_rhs
+class tl_model(ctypes.Structure):
+    _fields_ = [(name, INT) for name in
+                ('n', 'threads', 'poles', 'displacement', 'M')] + \
+        [(name, DOUBLE) for name in
+         ('dt', 'c', 'd_m_factor', 'RK4_0', 'RK4G_0')] + \
+        [(name, PDOUBLE) for name in
+         ('knee', 'const_nl1', 'Sa', 'Sb', 'sinTheta', 'cosTheta', 'PoleS',
+          'PoleE', 'Pnew', 'SheraP', 'SheraD', 'SheraMu', 'SheraRho',
+          'omega', 'omega2', 'Sherad_factor', 'ZASQ', 'Ybuffer', 'Dev',
+          'YZweig', 'g', 'right', 'passive', 'Qsol')] + \
+        [(name, PINT) for name in ('Zrp', 'Zrp1', 'Zrp2', 'Zrp3')] + \
+        [('tridata', ctypes.POINTER(tridiag_matrix)), ('times', PDOUBLE)]
+
+
+# TLsolver in one parallel region, on every number of threads
+libtrisolv.tl_rhs.restype = INT
+libtrisolv.tl_rhs.argtypes = [ctypes.POINTER(tl_model),
+                              VECTOR,  # y
+                              VECTOR,  # dy
+                              DOUBLE,  # frac
+                              DOUBLE,  # p0x*F0
+                              INT  # Zwp
+                              ]
 
+# definition of the function
 
-def TLsolver(t, y, model):  # y''=dv/dt y'=v
-    n = model.n + 1
-    frac = (t - model.lastT) / model.dt
+timer = getattr(time, 'perf_counter', time.time)
+
+
+# counters of a solve (cochlea_model.stats), cheap enough to be always on:
+# right hand side evaluations (TLsolver), samples solved and skipped as
+# silent (cochlea_model.silence), accepted and rejected dopri5 steps,
+# tridiagonal solves of the imex integrator, pole updates of the 1% check
+# with the sections that moved by more than 1% and the sections recomputed,
+# seconds per kernel and the peak resident memory of the process. In
+# TLsolver (tl_rhs) the delay line is counted in g_right.
+def new_stats():
+    return {'samples': 0, 'skipped_samples': 0, 'rhs_evaluations': 0,
+            'accepted_steps': 0, 'rejected_steps': 0, 'imex_solves': 0,
+            'pole_updates': 0, 'sections_moved': 0, 'sections_recomputed': 0,
+            'time': {'rhs': 0., 'nonlinearity': 0., 'delay_line': 0.,
+                     'g_right': 0., 'tridiagonal': 0., 'imex_assembly': 0.,
+                     'solve': 0.},
+            'peak_memory_mb': 0.}
+
+
+# solver state of a checkpoint (cochlea_model.checkpoint) besides the sample,
+# the integrator, the Zweig delay line and the solution so far. The arrays
+# are restored in place, the C kernels hold pointers into them.
+CHECKPOINT_ARRAYS = ['Vtmp', 'Ytmp', 'g', 'right', 'Qsol', 'passive',
+                     'SheraP', 'SheraD', 'SheraRho', 'SheraMu', 'YZweig',
+                     'Dev', 'Zrp', 'Zrp1', 'Zrp2', 'Zrp3']
+CHECKPOINT_SCALARS = ['Zwp', 'lastT', 'current_t', 'interplPoint1']
+# the solution so far, next to the checkpoint in <checkpoint>.<name>.npy
+CHECKPOINT_SOLUTION = {'V': 'Vsolution', 'Y': 'Ysolution',
+                       'A': 'organ_of_corti_acceleration'}
+
+
+def peak_memory_mb():
+    if resource is None:
+        return 0.
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # bytes on mac os, kilobytes elsewhere
+    return rss / 2. ** 20 if sys.platform == 'darwin' else rss / 1024.
+
+
+def stimulus_sample(model, frac):
     a = model.interplPoint1
     b = model.interplPoint2
     c = model.interplPoint3
     d = model.interplPoint4
     cminusb = c - b
     #fast cubic interpolation
-    F0 = b + frac * \
+    return b + frac * \
         (cminusb - 0.1666667 * (1. - frac) *
          ((d - a - 3.0 * cminusb) * frac + (d + 2.0 * a - 3.0 * b)))
-    model.Vtmp = y[0:n]
-    model.Ytmp = y[n:2 * n]
+
+
+# poles of the non-linearity for the velocities, or with the displacement
+# non-linearity the displacements, X (one row per time point if X is a
+# matrix)
+def knee_poles(model, X):
+    factor = 100
+    Xvect = np.abs(X) / model.knee
+    Sxp = (Xvect - 1.) * model.const_nl1
+    Syp = model.Sb * np.sqrt(1 + (Sxp / model.Sa) ** 2)
+    Sy = Sxp * model.sinTheta + Syp * model.cosTheta
+    SheraP = model.PoleS + Sy / factor
+    return np.fmin(SheraP, model.PoleE)
+
+
+def update_poles(model, V, Y, t):
+    n = model.n + 1
     if(model.use_Zweig):  # non-linearities here
-        factor = 100
-        Vvect = np.abs(model.Vtmp) / model.RthV1
-        Sxp = (Vvect - 1.) * model.const_nl1
-        Syp = model.Sb * np.sqrt(1 + (Sxp / model.Sa) ** 2)
-        Sy = Sxp * model.sinTheta + Syp * model.cosTheta
-        SheraP = model.PoleS + Sy / factor
-        SheraP = np.fmin(SheraP, model.PoleE)
+        SheraP = knee_poles(model, Y if model.non_linearity == 1 else V)
         # update non-linear parameters here only if the pole displacement is
         # larger than 1%
-        if(np.max(abs(SheraP[1:n] - model.SheraP[1:n]) /
-           abs(model.SheraP[1:n])) > 0.01):
-            model.SheraP = SheraP
+        moved = abs(SheraP[1:n] - model.SheraP[1:n]) / abs(model.SheraP[1:n])
+        if(np.max(moved) > 0.01):
+            model.stats['pole_updates'] += 1
+            model.stats['sections_moved'] += int(np.count_nonzero(
+                moved > 0.01))
+            model.stats['sections_recomputed'] += n
+            model.SheraP[:] = SheraP
             model.SheraParameters()
             model.ZweigImpedance()
             model.current_t = t
+
+
+# YZweig at the fractional sample frac of the current step
+def delay_line(model, frac):
+    n = model.n + 1
+    if(model.threads > 1):
+        libtrisolv.delay_line_mt(
+            model.Ybuffer_pointer, model.Zrp_pointer, model.Zrp1_pointer,
+            model.Zrp2_pointer, model.Zrp3_pointer, model.Dev_pointer, frac,
+            model.YZweig_pointer, model.YbufferLgt, n, model.threads)
+        return
     model.Dev[0:n] = model.Dev[0:n] + frac
     libtrisolv.delay_line(
         model.Ybuffer_pointer, model.Zrp_pointer, model.Zrp1_pointer,
         model.Zrp2_pointer, model.Zrp3_pointer, model.Dev_pointer,
         model.YZweig_pointer, ctypes.c_int(model.YbufferLgt),
-        ctypes.c_int(model.n + 1))
-    model.Dev[0:n] = model.Dev[0:n] - frac
-    model.calculate_g()
-    model.calculate_right(F0)
-    #compute q
-    libtrisolv.solve_tridiagonal(
-        ctypes.byref(model.tridata), model.r_pointer, model.Qpointer,
         ctypes.c_int(n))
-    #ME equation
-    zero_val = (model.RK4_0 * model.Qsol[
-                0] + model.RK4G_0 * (model.g[0] + model.p0x * F0))
-    Vderivative = (model.Qsol - model.g)
-    Vderivative[0] = zero_val
+    model.Dev[0:n] = model.Dev[0:n] - frac
+
+
+def solve_tridiagonal(model, tridata, r_pointer, x_pointer):
+    if(model.threads > 1):
+        libtrisolv.solve_tridiagonal_mt(
+            ctypes.byref(tridata), r_pointer, x_pointer, model.n + 1,
+            model.threads)
+    else:
+        libtrisolv.solve_tridiagonal(
+            ctypes.byref(tridata), r_pointer, x_pointer,
+            ctypes.c_int(model.n + 1))
+
+
+# the pole update (update_poles), delay line, g, right hand side,
+# tridiagonal solve and middle ear equation of a right hand side are one
+# call of tl_rhs, on model.threads threads
+def TLsolver(t, y, model):  # y''=dv/dt y'=v
+    t0 = timer()
+    n = model.n + 1
+    frac = (t - model.lastT) / model.dt
+    F0 = stimulus_sample(model, frac)
+    model.rhs.threads = model.threads
+    moved = libtrisolv.tl_rhs(ctypes.byref(model.rhs), y, model.dy, frac,
+                              model.p0x * F0, model.Zwp)
+    model.Vtmp = y[0:n]
+    model.Ytmp = y[n:2 * n]
+    stats = model.stats
+    if(moved >= 0):
+        stats['pole_updates'] += 1
+        stats['sections_moved'] += moved
+        stats['sections_recomputed'] += n
+        model.current_t = t
+    stats['rhs_evaluations'] += 1
+    times = stats['time']
+    times['nonlinearity'] += model.rhs_times[0]
+    times['g_right'] += model.rhs_times[1]
+    times['tridiagonal'] += model.rhs_times[2]
+    model.rhs_times[:] = 0.
+    times['rhs'] += timer() - t0
     #output the velocity input as displacement derivative output.
-    solution = np.concatenate([Vderivative, model.Vtmp])
-    return solution
+    return model.dy
 
 
 class cochlea_model ():
@@ -137,6 +274,25 @@ class cochlea_model ():
         self.Rme = float(0.3045192500000000e12)  # TODO setRme function
         #variable to check if the model is intialize before calling the solver
         self._is_init = 0
+        # threads of the right hand side of one cochlea, see tl_rhs
+        self.threads = 1
+        # silence fast-forward of solve: while the stimulus and the state
+        # (velocity, and displacement and the Zweig delay line times the CF
+        # in rad/s) stay below this fraction of their maxima, the samples
+        # are left zero and the model restarts from rest at the next sound.
+        # None integrates everything.
+        # Only the sections from silence_cf (Hz) up count, the apex below
+        # rings for hundreds of ms and has no AN fibers.
+        self.silence = None
+        self.silence_cf = 80.
+        # checkpoint file of solve: the complete solver state is written to
+        # it every checkpoint_interval seconds, and a solve of the same run
+        # (stimulus, model and integrator) resumes from it exactly. It is
+        # removed when the solve is done. None does not checkpoint.
+        self.checkpoint = None
+        self.checkpoint_interval = 600.
+        # counters of the last solve, see new_stats
+        self.stats = new_stats()
         self.interplPoint1 = 0
         self.interplPoint2 = 0
         self.interplPoint3 = 0
@@ -146,7 +302,21 @@ class cochlea_model ():
     def init_model(self, stim, samplerate, sections, probe_freq, sheraPo,
                    compression_slope=0.4, Zweig_irregularities=1,
                    non_linearity_type="vel", KneeVar=1.,
-                   low_freq_irregularities=1, subject=1):
+                   low_freq_irregularities=1, subject=1, Vthresholds=None):
+        self.init_parameters(samplerate, sections, probe_freq, sheraPo,
+                             compression_slope, Zweig_irregularities,
+                             non_linearity_type, KneeVar,
+                             low_freq_irregularities, subject, Vthresholds)
+        self.initState()
+        self.init_stimulus(stim)
+
+    # everything that does not depend on the stimulus, this is what a model
+    # snapshot holds (see model_snapshot.py)
+    def init_parameters(self, samplerate, sections, probe_freq, sheraPo,
+                        compression_slope=0.4, Zweig_irregularities=1,
+                        non_linearity_type="vel", KneeVar=1.,
+                        low_freq_irregularities=1, subject=1,
+                        Vthresholds=None):
         self.low_freq_irregularities = low_freq_irregularities
         self.SheraPo = np.zeros_like(sheraPo)
         self.SheraPo = sheraPo  # can be vector or single value
@@ -178,13 +348,25 @@ class cochlea_model ():
         np.random.RandomState(self.seed)
         np.random.seed(self.seed)
         self.Rth = 2 * (np.random.random(self.n + 1) - 0.5)
-        self.Rth_norm = 10 ** (self.Rth / 20. / self.KneeVar)
+        # the knees vary by up to +-KneeVar dB from section to section
+        # (useKneeVar of PoleCalculation.f90), 0 leaves them at the knee
+        self.Rth_norm = 10 ** (self.Rth * self.KneeVar / 20.)
         lf_limit = self.ctr
         if(self.use_Zweig):
             factor = 100
             n = self.n + 1
             Rth = self.Rth
-            Rth_norm = self.Rth_norm
+            # external knee velocities of the sections (Vthresholds.dat, of
+            # sections 1..n as in the fortran model, or of all), the other
+            # knees are moved by the same factor
+            knee = np.ones(n)
+            if Vthresholds is not None:
+                knee = np.asarray(Vthresholds, dtype=np.float64) / \
+                    self.Vknee1
+                if knee.ndim and len(knee) == n - 1:
+                    knee = np.concatenate([knee[0:1], knee])
+                knee = knee * np.ones(n)
+            Rth_norm = self.Rth_norm * knee
             #Normalized RTH, so save a bit of computation
             self.RthY1 = self.Yknee1 * Rth_norm
             self.RthY2 = self.Yknee2 * Rth_norm
@@ -194,16 +376,23 @@ class cochlea_model ():
             Rndm = self.IrrPct * Rth / 2.
             self.PoleS = (1 + Rndm) * self.SheraPo
 
-            self.RthY1[lf_limit:n] = self.Yknee1
-            self.RthY2[lf_limit:n] = self.Yknee2
-            self.RthV1[lf_limit:n] = self.Vknee1
-            self.RthV2[lf_limit:n] = self.Vknee2
+            self.RthY1[lf_limit:n] = self.Yknee1 * knee[lf_limit:n]
+            self.RthY2[lf_limit:n] = self.Yknee2 * knee[lf_limit:n]
+            self.RthV1[lf_limit:n] = self.Vknee1 * knee[lf_limit:n]
+            self.RthV2[lf_limit:n] = self.Vknee2 * knee[lf_limit:n]
             self.PoleS[lf_limit:n] = self.SheraPo[lf_limit:n]
+            if(self.non_linearity == 1):
+                # the displacement knees are proportional to 1/omega, those
+                # of the model at the 1 kHz section
+                self.knee = self.RthY1 * self.omega[self.onek] / self.omega
+                ratio = self.RthY2 / self.RthY1
+            else:
+                self.knee = self.RthV1
+                ratio = self.RthV2 / self.RthV1
             Theta0 = np.arctan(
-                ((self.PoleE - self.PoleS) * factor) /
-                ((self.RthV2 / self.RthV1) - 1.))
+                ((self.PoleE - self.PoleS) * factor) / (ratio - 1.))
             Theta = Theta0 / 2.
-            Sfoc = (self.PoleS * factor) / (self.RthV2 / self.RthV1)
+            Sfoc = (self.PoleS * factor) / ratio
             Se = np.cos((np.pi - Theta0) * 0.5)
             self.Sb = Sfoc * Se
             self.Sa = Sfoc * np.sqrt(1. - ((Se ** 2)))
@@ -211,11 +400,12 @@ class cochlea_model ():
             self.cosTheta = np.cos(Theta)
             self.sinTheta = np.sin(Theta)
 
+    def init_stimulus(self, stim):
+        samplerate = self.fs
         #
         # PURIAM1 FILTER             ###
         #
         puria_gain = 10 ** (18. / 20.) * 2.
-<<<<<<< HEAD
         ## was the orignal Puria in 2012
         ##second order butterworth
         ##b, a = signal.butter(
@@ -224,19 +414,12 @@ class cochlea_model ():
         ## self.stim = signal.lfilter(b * puria_gain, a, stim)
         
         #below is the modified version.   
-        b1,a1=signal.butter(2,[600./(samplerate/2.)],'high') #second order butterworth
-        b2,a2=signal.butter(1,[4000.0/(samplerate/2.)],'low')
+        b1,a1=signal.butter(2,600./(samplerate/2.),'high') #second order butterworth
+        b2,a2=signal.butter(1,4000.0/(samplerate/2.),'low')
         b=signal.convolve(b1,b2)
         a=signal.convolve(a1,a2)
         self.stim=signal.lfilter(b*puria_gain,a,stim) 
 
-=======
-        #second order butterworth
-        b, a = signal.butter(
-            1, [100. / (samplerate / 2.), 3000. / (samplerate / 2)],
-            'bandpass')
-        self.stim = signal.lfilter(b * puria_gain, a, stim)
->>>>>>> 47cf2b327fafa10991497f50996f2b61bc7bd74e
 
     # from intializeCochlea.f90
     def initCochlea(self):
@@ -253,6 +436,9 @@ class cochlea_model ():
             np.linspace(0, self.bm_length, self.n + 1), order='C')
         self.dx = self.bm_length / (1. * self.n)
 
+    # buffers the solver writes to, these are never shared between models
+    def initState(self):
+        n = self.n + 1
         #
         # intialize other variables here for practical purpose
         #
@@ -266,6 +452,71 @@ class cochlea_model ():
         self.gamma = np.zeros_like(self.x)
         self.Qsol = np.zeros_like(self.x)
         self.Qpointer = self.Qsol.ctypes.data_as(PDOUBLE)
+        self.passive = np.zeros_like(self.x)
+        self.SheraP = np.array(self.SheraP)
+        self.SheraD = np.array(self.SheraD)
+        self.SheraRho = np.array(self.SheraRho)
+        self.SheraMu = np.array(self.SheraMu)
+
+        # Ybuffer implemented here as a dense matrix
+        # (python for cycles are slow...)
+        self.Ybuffer = np.zeros([n, self.YbufferLgt], dtype=float, order='C')
+        self.Ybuffer_pointer = self.Ybuffer.ctypes.data_as(PDOUBLE)
+        self.ZweigSample1 = np.zeros_like(self.exact_delay)
+        self.Zwp = int(0)
+        self.ZweigSample1[0] = 1.
+        self.ZweigSample2 = self.ZweigSample1 + 1
+        # init buffers etc...
+        self.Dev = np.zeros_like(self.x)
+        self.Dev_pointer = self.Dev.ctypes.data_as(PDOUBLE)
+        self.YZweig = np.zeros_like(self.x)
+        self.YZweig_pointer = self.YZweig.ctypes.data_as(PDOUBLE)
+        self.Zrp = np.array(np.zeros(n), dtype=np.int32, order='C')
+        self.Zrp_pointer = self.Zrp.ctypes.data_as(PINT)
+        self.Zrp1 = np.array(np.zeros(n), dtype=np.int32, order='C')
+        self.Zrp1_pointer = self.Zrp1.ctypes.data_as(PINT)
+        self.Zrp2 = np.array(np.zeros(n), dtype=np.int32, order='C')
+        self.Zrp2_pointer = self.Zrp2.ctypes.data_as(PINT)
+        self.Zrp3 = np.array(np.zeros(n), dtype=np.int32, order='C')
+        self.Zrp3_pointer = self.Zrp3.ctypes.data_as(PINT)
+
+        self.tridata = tridiag_matrix()
+        self.tridata.aa = self.ZAL.ctypes.data_as(PDOUBLE)
+        self.tridata.bb = self.ZASC.ctypes.data_as(PDOUBLE)
+        self.tridata.cc = self.ZAH.ctypes.data_as(PDOUBLE)
+        self.lastT = 0
+        self.interplPoint1 = 0
+        self.init_rhs()
+
+    # tl_rhs of TLsolver holds pointers into the arrays of the model, which
+    # are therefore only ever updated in place after initState
+    def init_rhs(self):
+        n = self.n + 1
+        self.dy = np.zeros(2 * n)
+        self.Pnew = np.zeros(n)
+        self.rhs_times = np.zeros(3)
+        rhs = tl_model()
+        rhs.n = n
+        rhs.threads = self.threads
+        rhs.poles = int(bool(self.use_Zweig))
+        rhs.displacement = int(self.non_linearity == 1)
+        rhs.M = self.YbufferLgt
+        for name in ('dt', 'c', 'd_m_factor', 'RK4_0', 'RK4G_0'):
+            setattr(rhs, name, float(getattr(self, name)))
+        for name, ctype in rhs._fields_[10:]:
+            if name in ('knee', 'const_nl1', 'Sa', 'Sb', 'sinTheta',
+                        'cosTheta', 'PoleS', 'PoleE') and \
+                    not self.use_Zweig:
+                a = self.x
+            elif name == 'tridata':
+                setattr(rhs, name, ctypes.pointer(self.tridata))
+                continue
+            elif name == 'times':
+                a = self.rhs_times
+            else:
+                a = getattr(self, name)
+            setattr(rhs, name, a.ctypes.data_as(ctype))
+        self.rhs = rhs
 
     def initMiddleEar(self):
         self.q0_factor = self.ZweigMpo * self.bm_width
@@ -314,28 +565,6 @@ class cochlea_model ():
         self.exact_delay = self.SheraMuMax / (self.f_resonance * self.dt)
         self.delay = np.floor(self.exact_delay) + 1
         self.YbufferLgt = int(np.amax(self.delay))
-        self.Ybuffer = np.zeros([n, self.YbufferLgt])
-                                # Ybuffer implemented here as a dense matrix
-                                # (python for cycles are slow...)
-        self.Ybuffer = np.array(self.Ybuffer, order='C', ndmin=2, dtype=float)
-        self.Ybuffer_pointer = self.Ybuffer.ctypes.data_as(PDOUBLE)
-        self.ZweigSample1 = np.zeros_like(self.exact_delay)
-        self.Zwp = int(0)
-        self.ZweigSample1[0] = 1.
-        self.ZweigSample2 = self.ZweigSample1 + 1
-        # init buffers etc...
-        self.Dev = np.zeros_like(self.x)
-        self.Dev_pointer = self.Dev.ctypes.data_as(PDOUBLE)
-        self.YZweig = np.zeros_like(self.x)
-        self.YZweig_pointer = self.YZweig.ctypes.data_as(PDOUBLE)
-        self.Zrp = np.array(np.zeros(n), dtype=np.int32, order='C')
-        self.Zrp_pointer = self.Zrp.ctypes.data_as(PINT)
-        self.Zrp1 = np.array(np.zeros(n), dtype=np.int32, order='C')
-        self.Zrp1_pointer = self.Zrp1.ctypes.data_as(PINT)
-        self.Zrp2 = np.array(np.zeros(n), dtype=np.int32, order='C')
-        self.Zrp2_pointer = self.Zrp2.ctypes.data_as(PINT)
-        self.Zrp3 = np.array(np.zeros(n), dtype=np.int32, order='C')
-        self.Zrp3_pointer = self.Zrp3.ctypes.data_as(PINT)
 
     #set tridiagonal matrix values for trasmission line
     def initGaussianElimination(self):
@@ -356,10 +585,6 @@ class cochlea_model ():
             0:n - 1] * (self.dx ** 2) / (self.ZweigOmega_co * self.ZweigMpo)
         self.ZASC[1:n] = self.ZASQ[1:n] + \
             self.ZweigMs[1:n] + self.ZweigMs[0:n - 1]
-        self.tridata = tridiag_matrix()
-        self.tridata.aa = self.ZAL.ctypes.data_as(PDOUBLE)
-        self.tridata.bb = self.ZASC.ctypes.data_as(PDOUBLE)
-        self.tridata.cc = self.ZAH.ctypes.data_as(PDOUBLE)
 
     def calculate_g(self):  # same as in fortran
         n = self.n + 1
@@ -367,7 +592,7 @@ class cochlea_model ():
         dtot = self.Sherad_factor * self.SheraD
         stot = (self.omega2) * (self.Ytmp + (self.SheraRho * self.YZweig))
         self.g[1:n] = (dtot[1:n] * self.Vtmp[1:n]) + stot[1:n]
-        self.passive = (
+        self.passive[:] = (
             dtot[0:n] * self.Vtmp + self.SheraRho * self.YZweig * self.omega2)
 
     def calculate_right(self, F0):  # same as in fortran
@@ -378,10 +603,10 @@ class cochlea_model ():
     def SheraParameters(self):  # same as in fortran
         a = (self.SheraP + np.sqrt((self.SheraP ** 2.) +
              self.c * (1.0 - self.SheraP ** 2))) / self.c
-        self.SheraD = 2.0 * (self.SheraP - a)
-        self.SheraMu = 1. / (a)
+        self.SheraD[:] = 2.0 * (self.SheraP - a)
+        self.SheraMu[:] = 1. / (a)
         # print self.SheraMu
-        self.SheraRho = 2. * a * \
+        self.SheraRho[:] = 2. * a * \
             np.sqrt(1. - (self.SheraD / 2.) ** 2.) * np.exp(-self.SheraP / a)
 
     def ZweigImpedance(self):
@@ -425,92 +650,329 @@ class cochlea_model ():
             Bx = self.SheraPo - Ax * 30.
             self.PoleE = self.PoleE + Ax * 97.4 + Bx
 
-    def polecalculation(self):  # TODO
-        # non-linearities  can be Wrapped from C for an additional boost, but
-        # must be done carefully (efficient memory allocation)
-        factor = 100.
-        # lf_limit = self.ctr
-        # n = self.n + 1
-        if(self.use_Zweig):
-            if(self.non_linearity == 1):  # To check
-                # non-linearity DISP cost about three times more than in
-                # fortran (Not implemented now)
-                Yknee1CST = self.RthY1 * self.omega[self.onek]
-                Yknee2CST = self.RthY2 * self.omega[self.onek]
-                Yknee1F = Yknee1CST / self.omega
-                Yknee2F = Yknee2CST / self.omega
-                Yvect = np.abs(self.Ytmp / Yknee1F)
-                Theta0 = np.arctan(
-                    ((self.PoleE - self.PoleS) / ((Yknee2F / Yknee1F) - 1.)))
-                Theta = Theta0 / 2.
-                # save 2 call to trigonometric function on vector by storing
-                # some data
-                cos_Theta = np.cos(Theta)
-                sin_Theta = np.sin(Theta)
-                cos_Theta0 = 2 * cos_Theta ** 2 - 1
-                Sfoc = self.PoleS * factor * (Yknee2F / Yknee1F)
-                Se = sin_Theta
-                Sb = Sfoc * Se
-                Sa = Sfoc * np.sqrt(1. - (1. * (Se ** 2)))
-                Sxp = (Yvect - 1.) * cos_Theta / cos_Theta0
-                Syp = Sb * np.sqrt(1 + (Sxp / Sa) ** 2)
-                Sy = Sxp * sin_Theta + Syp * cos_Theta
-                self.SheraP = self.PoleS + Sy / factor
-
-            elif(self.non_linearity == 2):  # non-linearity VEL
-                Vvect = np.abs(self.Vtmp) / self.RthV1
-                Sxp = (Vvect - 1.) * self.const_nl1
-                Syp = self.Sb * np.sqrt(1 + (Sxp / self.Sa) ** 2)
-                Sy = Sxp * self.sinTheta + Syp * self.cosTheta
-                self.SheraP = self.PoleS + Sy / factor
-
-        self.SheraP = np.fmin(self.SheraP, self.PoleE)
-
-    def solve(self):
+    # the poles of the current state, the constants of the displacement
+    # (non_linearity 1) and velocity (2) non-linearities are set up by
+    # init_parameters, so both cost the same
+    def polecalculation(self):
+        if(self.use_Zweig and self.non_linearity in (1, 2)):
+            self.SheraP[:] = knee_poles(self, self.Ytmp if
+                                        self.non_linearity == 1 else
+                                        self.Vtmp)
+        self.SheraP[:] = np.fmin(self.SheraP, self.PoleE)
+
+    # linearly implicit trapezoidal (Crank-Nicolson) integration of one
+    # sample: the section mechanics and the fluid coupling are implicit, the
+    # pole non-linearity, the delayed Zweig feedback and the stimulus are
+    # explicit. The mass matrix times V' is tridiagonal in the mean velocity
+    # u=(V_k+V_k+1)/2 of a step, so every step is one tridiagonal solve.
+    def initIMEX(self):
+        self.imex_a = np.zeros_like(self.x)
+        self.imex_b = np.zeros_like(self.x)
+        self.imex_c = np.zeros_like(self.x)
+        self.imex_r = np.zeros_like(self.x)
+        self.imex_u = np.zeros_like(self.x)
+        self.imex_r_pointer = self.imex_r.ctypes.data_as(PDOUBLE)
+        self.imex_u_pointer = self.imex_u.ctypes.data_as(PDOUBLE)
+        self.imex_tridata = tridiag_matrix()
+        self.imex_tridata.aa = self.imex_a.ctypes.data_as(PDOUBLE)
+        self.imex_tridata.bb = self.imex_b.ctypes.data_as(PDOUBLE)
+        self.imex_tridata.cc = self.imex_c.ctypes.data_as(PDOUBLE)
+
+    def imex_step(self, V, Y, substeps):
+        n = self.n + 1
+        h = self.dt / substeps
+        times = self.stats['time']
+        for m in range(substeps):
+            t0 = timer()
+            frac = (m + 0.5) / substeps
+            update_poles(self, V, Y, self.lastT + frac * self.dt)
+            F0 = stimulus_sample(self, frac)
+            t1 = timer()
+            delay_line(self, frac)
+            t2 = timer()
+            # g=c*u+e in the mean state of the step
+            c = self.Sherad_factor * self.SheraD + 0.5 * h * self.omega2
+            e = self.omega2 * (Y + self.SheraRho * self.YZweig)
+            c[0] = self.d_m_factor
+            e[0] = 0.
+            # q=alpha*u+beta, row 0 is the middle ear equation
+            alpha = 2. / h + c
+            beta = e - 2. / h * V
+            alpha[0] = (2. / h - self.RK4G_0 * self.d_m_factor) / self.RK4_0
+            beta[0] = -(2. / h * V[0] +
+                        self.RK4G_0 * self.p0x * F0) / self.RK4_0
+            self.imex_a[1:n] = self.ZAL[1:n] * alpha[0:n - 1]
+            self.imex_b[:] = self.ZASC * alpha - self.ZASQ * c
+            self.imex_c[0:n - 1] = self.ZAH[0:n - 1] * alpha[1:n]
+            self.imex_r[:] = self.ZASQ * e - self.ZASC * beta
+            self.imex_r[1:n] -= self.ZAL[1:n] * beta[0:n - 1]
+            self.imex_r[0:n - 1] -= self.ZAH[0:n - 1] * beta[1:n]
+            self.imex_r[0] += self.p0x * F0
+            t3 = timer()
+            solve_tridiagonal(self, self.imex_tridata, self.imex_r_pointer,
+                              self.imex_u_pointer)
+            V = 2. * self.imex_u - V
+            Y = Y + h * self.imex_u
+            self.stats['imex_solves'] += 1
+            times['nonlinearity'] += t1 - t0
+            times['delay_line'] += t2 - t1
+            times['imex_assembly'] += t3 - t2
+            times['tridiagonal'] += timer() - t3
+        return V, Y
+
+    # silent samples of the stimulus (the 4 samples interpolated in a step
+    # below silence*max|stim|) and per sample the next one that is not
+    def silent_samples(self, length):
+        level = np.abs(self.stim)
+        quiet = level <= self.silence * np.max(level)
+        silent = quiet[1:length + 1] & quiet[2:length + 2]
+        silent &= quiet[0:length]
+        silent[1:] &= quiet[0:length - 1]
+        sound = np.flatnonzero(~silent)
+        resume = np.full(length, length, dtype=int)
+        if len(sound):
+            after = np.searchsorted(sound, np.arange(length))
+            has = after < len(sound)
+            resume[has] = sound[after[has]]
+        return silent, resume
+
+    # the model at rest, as at the start of solve
+    def rest(self):
+        self.Ybuffer[:] = 0
+        self.YZweig[:] = 0
+        self.Vtmp = np.zeros_like(self.x)
+        self.Ytmp = np.zeros_like(self.x)
+        self.Qsol[:] = 0.
+        self.passive[:] = 0.
+        self.polecalculation()
+        self.SheraParameters()
+        self.ZweigImpedance()
+
+    # fingerprint of a run, a checkpoint only resumes the same run
+    def checkpoint_key(self, integrator, substeps):
+        h = hashlib.sha1()
+        for a in (self.stim, self.SheraPo, self.Rth, self.x) + (
+                (self.knee,) if self.use_Zweig else ()):
+            h.update(np.ascontiguousarray(a, dtype=np.float64).tobytes())
+        h.update(repr((self.fs, integrator,
+                       substeps, self.silence, self.silence_cf,
+                       self.non_linearity, self.use_Zweig)).encode())
+        return h.hexdigest()
+
+    # the samples of the Zweig ring buffer the delay line can still read,
+    # per section the last delay+2, as a mask over the ring ordered from the
+    # newest sample back (most sections need a small part of the ring)
+    def delay_history(self):
+        back = np.arange(self.YbufferLgt)
+        order = (self.Zwp - back) % self.YbufferLgt
+        return order, back[None, :] <= self.delay[:, None] + 2
+
+    # write the state at sample j to the checkpoint and the solution from
+    # sample saved on next to it, the state file is replaced last so it
+    # never points past the saved solution
+    def save_checkpoint(self, key, j, saved, y, r, extra):
+        for name, attr in CHECKPOINT_SOLUTION.items():
+            a = getattr(self, attr)
+            f = self.checkpoint + '.' + name + '.npy'
+            if saved == 0 or not os.path.exists(f):
+                m = np.lib.format.open_memmap(f, mode='w+', dtype=a.dtype,
+                                              shape=a.shape)
+            else:
+                m = np.load(f, mmap_mode='r+')
+            m[:, saved:j] = a[:, saved:j]
+            m.flush()
+            del m
+        state = dict((k, getattr(self, k)) for k in CHECKPOINT_ARRAYS)
+        state.update((k, np.asarray(getattr(self, k)))
+                     for k in CHECKPOINT_SCALARS)
+        state.update(extra)
+        order, keep = self.delay_history()
+        state.update(key=key, j=j, y=y, Yring=self.Ybuffer[:, order][keep],
+                     oto_emission=self.oto_emission[:j],
+                     stats=json.dumps(self.stats))
+        if r is not None:
+            # dopri5 keeps its step size between the integrate calls
+            state.update(t=r.t, work=r._integrator.work,
+                         iwork=r._integrator.iwork)
+        tmp = self.checkpoint + '.tmp'
+        with open(tmp, 'wb') as f:
+            np.savez(f, **state)
+        os.rename(tmp, self.checkpoint)
+
+    # the state of the checkpoint of this run (restored in place) and the
+    # rest of it as a dict, None without one
+    def load_checkpoint(self, key):
+        if self.checkpoint is None or not os.path.exists(self.checkpoint):
+            return None
+        state = dict(np.load(self.checkpoint))
+        if str(state['key']) != key:
+            print("checkpoint " + self.checkpoint + " is of another run")
+            return None
+        j = int(state['j'])
+        for k in CHECKPOINT_ARRAYS:
+            getattr(self, k)[...] = state[k]
+        for k in CHECKPOINT_SCALARS:
+            setattr(self, k, state[k].item())
+        order, keep = self.delay_history()
+        ring = np.zeros(self.Ybuffer.shape, self.Ybuffer.dtype)
+        ring[keep] = state['Yring']
+        self.Ybuffer[:, order] = ring
+        for name, attr in CHECKPOINT_SOLUTION.items():
+            m = np.load(self.checkpoint + '.' + name + '.npy', mmap_mode='r')
+            getattr(self, attr)[:, 0:j] = m[:, 0:j]
+            del m
+        self.oto_emission[0:j] = state['oto_emission']
+        self.stats = json.loads(str(state['stats']))
+        print("resuming from checkpoint at sample %d" % j)
+        return state
+
+    def remove_checkpoint(self):
+        for f in [self.checkpoint] + [self.checkpoint + '.' + name + '.npy'
+                                      for name in CHECKPOINT_SOLUTION]:
+            if os.path.exists(f):
+                os.remove(f)
+
+    # integrator='dopri5' (default) or 'imex', substeps are the imex steps
+    # per sample (fewer than 4 is unstable at low levels, see
+    # integrator_report.py). With a checkpoint, a segment (samples) ends the
+    # solve early after writing the checkpoint, the next solve continues
+    # there. out, a (V, Y) pair of [section x sample] arrays (e.g. rows of
+    # the output slabs), is used as Vsolution and Ysolution instead of new
+    # arrays. Returns whether the solve is complete.
+    def solve(self, integrator='dopri5', substeps=4, segment=None, out=None):
         n = self.n + 1
         tstart = time.time()
+        self.stats = new_stats()
         if not(self.is_init):
             print("Error: model to be initialized")
         length = np.size(self.stim) - 2
         time_length = length * self.dt
         #each probe point signal in a row
-        self.Vsolution = np.zeros([len(self.x), length + 2])
-        self.Ysolution = np.zeros([len(self.x), length + 2])
+        if out is None:
+            self.Vsolution = np.zeros([len(self.x), length + 2])
+            self.Ysolution = np.zeros([len(self.x), length + 2])
+        else:
+            # the silent samples are left zero
+            self.Vsolution, self.Ysolution = out
+            self.Vsolution[...] = 0
+            self.Ysolution[...] = 0
         self.organ_of_corti_acceleration = np.zeros([len(self.x), length + 2])
         self.oto_emission = np.zeros(length + 2)
         self.time_axis = np.linspace(0, time_length, length)
-        r = ode(TLsolver).set_integrator('dopri5', rtol=1e-2, atol=1e-13)
-        r.set_f_params(self)
-        r.set_initial_value(
-            np.concatenate([np.zeros_like(self.x), np.zeros_like(self.x)]))
-        r.t = 0
+        if self.silence is not None:
+            silent, resume = self.silent_samples(length)
+            counted = self.f_resonance >= self.silence_cf
+            omega = self.omega[counted]
+            Vpeak = Ypeak = 0.
+            # max omega*|Y| of the samples the Zweig delay line of these
+            # sections still reads
+            Yhistory = np.zeros(int(np.max(self.delay[counted])) + 1)
+        if(integrator == 'imex'):
+            self.initIMEX()
+            y = np.concatenate([np.zeros_like(self.x), np.zeros_like(self.x)])
+        else:
+            r = ode(TLsolver).set_integrator('dopri5', rtol=1e-2, atol=1e-13)
+            r.set_f_params(self)
+            r.set_initial_value(
+                np.concatenate([np.zeros_like(self.x), np.zeros_like(self.x)]))
+            r.t = 0
         j = 0
         self.last_t = 0.0
-        self.current_t = r.t
+        self.current_t = 0.0
         self.polecalculation()
         self.SheraParameters()
         self.ZweigImpedance()
+        if self.checkpoint is not None:
+            key = self.checkpoint_key(integrator, substeps)
+            state = self.load_checkpoint(key)
+            if state is not None:
+                j = int(state['j'])
+                y = state['y'].copy()
+                if(integrator != 'imex'):
+                    r.set_initial_value(y, float(state['t']))
+                    r._integrator.work[:] = state['work']
+                    r._integrator.iwork[:] = state['iwork']
+                if self.silence is not None:
+                    Vpeak = float(state['Vpeak'])
+                    Ypeak = float(state['Ypeak'])
+                    Yhistory[:] = state['Yhistory']
+            saved = j
+            end = length if segment is None else min(length, j + segment)
+            tsaved = timer()
+        solve_time = self.stats['time']['solve']
         while(j < length):
+            if(self.checkpoint is not None and j > saved and
+               (j >= end or timer() - tsaved >= self.checkpoint_interval)):
+                extra = {}
+                if self.silence is not None:
+                    extra = {'Vpeak': Vpeak, 'Ypeak': Ypeak,
+                             'Yhistory': Yhistory}
+                self.stats['time']['solve'] = solve_time + time.time() - \
+                    tstart
+                self.save_checkpoint(key, j, saved,
+                                     y if integrator == 'imex' else r.y,
+                                     None if integrator == 'imex' else r,
+                                     extra)
+                saved = j
+                tsaved = timer()
+                if(j >= end):
+                    return False
+            if(self.silence is not None and silent[j] and
+               np.max(np.abs(self.Vtmp[counted])) <= self.silence * Vpeak and
+               np.max(Yhistory) <= self.silence * Ypeak):
+                # the skipped samples stay zero in the solution
+                self.stats['skipped_samples'] += int(resume[j] - j)
+                j = resume[j]
+                self.lastT = j * self.dt
+                self.current_t = self.lastT
+                self.rest()
+                Yhistory[:] = 0.
+                y = np.concatenate([np.zeros_like(self.x),
+                                    np.zeros_like(self.x)])
+                if(integrator != 'imex'):
+                    r.set_initial_value(y, self.lastT)
+                if(j >= length):
+                    break
             if(j > 0):
                 self.interplPoint1 = self.stim[j - 1]
             # assign the stimulus points and interpolation parameters
             self.interplPoint2 = self.stim[j]
             self.interplPoint3 = self.stim[j + 1]
             self.interplPoint4 = self.stim[j + 2]
-            r.integrate(r.t + self.dt)
-            self.lastT = r.t
-            self.Vtmp = r.y[0:n]
-            self.Ytmp = r.y[n:2 * n]  # Non linearities HERE
+            if(integrator == 'imex'):
+                V, Y = self.imex_step(y[0:n], y[n:2 * n], substeps)
+                y = np.concatenate([V, Y])
+                # q0 and the passive force at the end of the sample
+                TLsolver((j + 1) * self.dt, y, self)
+                self.lastT = (j + 1) * self.dt
+            else:
+                r.integrate(r.t + self.dt)
+                self.lastT = r.t
+                y = r.y
+                # dopri5 counts the steps of every integrate call in iwork
+                # (NACCPT, NREJCT)
+                iwork = getattr(r._integrator, 'iwork', None)
+                if iwork is not None:
+                    self.stats['accepted_steps'] += int(iwork[18])
+                    self.stats['rejected_steps'] += int(iwork[19])
+            self.Vtmp = y[0:n]
+            self.Ytmp = y[n:2 * n]  # Non linearities HERE
             self.Zwp = (self.Zwp + 1) % self.YbufferLgt  # update Zweig Buffer
             self.Ybuffer[:, self.Zwp] = self.Ytmp
             self.ZweigImpedance()
-            self.current_t = r.t
+            if self.silence is not None:
+                Vpeak = max(Vpeak, np.max(np.abs(self.Vtmp[counted])))
+                k = j % len(Yhistory)
+                Yhistory[k] = np.max(np.abs(self.Ytmp[counted]) * omega)
+                Ypeak = max(Ypeak, Yhistory[k])
+            self.current_t = self.lastT
 
             self.Vsolution[:, j] = self.Vtmp[
                 :]  # storing all probe points (Debug)
             self.Ysolution[:, j] = self.Ytmp[:]
             self.organ_of_corti_acceleration[:, j] = self.passive[:]
             self.oto_emission[j] = self.Qsol[0]
+            self.stats['samples'] += 1
             j = j + 1
     # filter out the otoacoustic emission ####
         samplerate = self.fs
@@ -519,5 +981,10 @@ class cochlea_model ():
         self.oto_emission = signal.lfilter(
             b * self.q0_factor, a, self.oto_emission)
         elapsed = time.time() - tstart
+        self.stats['time']['solve'] = solve_time + elapsed
+        self.stats['peak_memory_mb'] = peak_memory_mb()
+        if self.checkpoint is not None:
+            self.remove_checkpoint()
         print(elapsed)
+        return True
 # END
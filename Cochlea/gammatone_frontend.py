@@ -0,0 +1,217 @@
+# -*- coding: utf-8 -*-
+# gammatone filterbank front end, a fast alternative to the TL model
+#
+# usage: python gammatone_frontend.py [input.mat [output.mat]]
+#
+# Every section of the canonical grid gets a gammatone filter (the wide band
+# gammatone of the Zilany AN model, gammatone_bank in cochlea_utils.c)
+# fitted to the TL model: the best frequency, peak gain and -10 dB
+# bandwidth of a section are taken from the impulse response of the TL
+# model in its linear regime (linear_response.py, cached), so at low
+# levels the filterbank gives the BM velocity of the TL model around the
+# best frequency of every section (within about 10% for clicks), on the
+# same grid. It has no travelling wave delay, emissions or low frequency
+# tails, so the basal sections and the sections basal of a tone respond
+# weaker than in the TL model.
+# The filterbank is linear by default. With LevelDependent the filters of a
+# channel lose (1-CompressionSlope) dB of gain per dB above the knee of the
+# TL non-linearity, and every one of the Order stages widens by its share of
+# that loss. This follows the TL model for tones at CF (about -6, -31 and
+# -40 dB at 40, 80 and 100 dB SPL), but not for transients such as clicks,
+# as the non-linearity of the TL model acts on the instantaneous velocity.
+# Peak |V| of the filterbank over the TL model for the 80 us click of
+# precision_report.py, at the sections of CF 7.7, 1.7 and 0.3 kHz:
+#   level [dB]  0-30            50              70              90
+#   linear      1.06 1.08 1.02  1.06 1.08 1.02  1.34 2.56 1.08  2.86 7.19 3.17
+#   level dep.  1.06 1.08 1.02  0.38 0.38 0.39  0.17 0.32 0.14  0.13 0.32 0.15
+# so use the linear filterbank for clicks up to 50 dB only.
+#
+# The output has the format of run_cochlear_model.py (Fc on the Greenwood
+# grid, Displacement as the integral of the velocity, no emission), so
+# ANClick.m and the later stages run on it unchanged.
+import os
+import sys
+import time
+from math import pi
+import numpy as np
+import scipy.io as sio
+import cochlear_model
+import linear_response
+import model_snapshot
+import run_cochlear_model
+import stage_cache
+
+Order = 4
+LevelDependent = False
+# compression of the TL model (compression_slope_param, slope 0.4): from
+# 30 dB up to the level where the poles reach PoleE
+CompressionSlope = 0.4
+Knee = (30., 97.4)
+# length of the impulse response the filters are fitted to, long enough
+# for the apical sections
+FitLength = 8192
+
+cochlear_model.libtrisolv.gammatone_bank.restype = None
+cochlear_model.libtrisolv.gammatone_bank.argtypes = [
+    cochlear_model.VECTOR, cochlear_model.INT,  # x, M
+    cochlear_model.VECTOR, cochlear_model.VECTOR,  # cf, tau
+    cochlear_model.VECTOR, cochlear_model.INT,  # gain, order
+    cochlear_model.DOUBLE, cochlear_model.VECTOR,  # tdres, out
+    cochlear_model.INT]
+
+
+def gammatone_bank(x, fs, cf, tau, gain, order=Order):
+    """gammatone outputs of all sections [section x time] for the input x"""
+    x = np.ascontiguousarray(x, dtype=np.float64)
+    n = len(cf)
+    out = np.zeros(len(x) * n)
+    cochlear_model.libtrisolv.gammatone_bank(
+        x, len(x), np.ascontiguousarray(cf, dtype=np.float64),
+        np.ascontiguousarray(tau, dtype=np.float64),
+        np.ascontiguousarray(gain, dtype=np.float64), order, 1. / fs, out, n)
+    return out.reshape(len(x), n).T
+
+
+def full_grid(params):
+    """init_parameters arguments of params on the canonical grid"""
+    return dict(params, sections=run_cochlear_model.sectionsNo,
+                sheraPo=run_cochlear_model.resample_sections(
+                    params['sheraPo'], run_cochlear_model.sectionsNo))
+
+
+def fit(params):
+    """best frequency, time constant and gain of the gammatones of a model
+    (params of init_parameters), from its linear impulse response"""
+    params = full_grid(params)
+    fs = params['samplerate']
+    Vir = linear_response.impulse_response(params, FitLength)[0]
+    H = abs(np.fft.rfft(Vir, axis=1))
+    df = fs / Vir.shape[1]
+    peak = np.argmax(H[:, 1:-1], axis=1) + 1
+    # best frequency between the bins, parabola through the log magnitudes
+    rows = np.arange(len(H))
+    l, c, r = [np.log(H[rows, peak + k] + 1e-300) for k in (-1, 0, 1)]
+    shift = 0.5 * (l - r) / np.where(l - 2 * c + r < 0, l - 2 * c + r, -1.)
+    cf = (peak + np.clip(shift, -0.5, 0.5)) * df
+    hmax = H[rows, peak]
+    # -10 dB bandwidth around the peak (the low frequency tail of the TL
+    # responses would widen an ERB), between the bins in dB
+    dB = 20 * np.log10(H / hmax[:, np.newaxis] + 1e-300) + 10.
+    idx = np.arange(H.shape[1])
+    below = dB < 0
+    left = np.max(np.where(below & (idx < peak[:, np.newaxis]), idx, 0), 1)
+    right = np.min(np.where(below & (idx > peak[:, np.newaxis]), idx,
+                            H.shape[1] - 1), 1)
+    fl = left + dB[rows, left] / (dB[rows, left] - dB[rows, left + 1])
+    fr = right - dB[rows, right] / (dB[rows, right] - dB[rows, right - 1])
+    bw10 = (np.minimum(fr, H.shape[1] - 1) - np.maximum(fl, 0)) * df
+    # of a gammatone |H| ~ (1+((f-cf)/b)^2)^(-Order/2)
+    tau = 1. / (2 * pi * bw10 / (2 * np.sqrt(10 ** (1. / Order) - 1)))
+    # peak gain of the gammatones themselves, from their impulse response
+    impulse = np.zeros(FitLength)
+    impulse[0] = 1.
+    G = abs(np.fft.rfft(gammatone_bank(impulse, fs, cf, tau,
+                                       np.ones(len(cf))), axis=1))
+    return cf, tau, hmax / np.max(G, axis=1)
+
+
+def level_parameters(cf, tau, gain, spl):
+    """time constants and gains of the filters of a channel at spl"""
+    if not LevelDependent:
+        return tau, gain
+    loss = (1 - CompressionSlope) * (np.clip(spl, Knee[0], Knee[1]) - Knee[0])
+    # every stage loses loss/Order dB of gain by widening, the gain at the
+    # best frequency of one stage is proportional to its time constant
+    widen = 10 ** (loss / 20. / Order)
+    return tau / widen, gain / widen ** Order
+
+
+def solve_channel(stim, run, i, fitted):
+    """V and Y [section x time] of channel i"""
+    coch = model_snapshot.load_model(full_grid(run_cochlear_model.model_params(
+        run, run['irregularities'][i])))
+    coch.init_stimulus(stim)
+    fs = coch.fs
+    cf, tau, gain = fitted
+    tau, gain = level_parameters(cf, tau, gain, run['spl'][i])
+    V = gammatone_bank(coch.stim, fs, cf, tau, gain)
+    Y = np.cumsum(V, axis=1) / fs
+    x = np.linspace(0, coch.bm_length, run_cochlear_model.sectionsNo + 1)
+    Fc = coch.Greenwood_A * 10 ** (-coch.Greenwood_alpha * x) - \
+        coch.Greenwood_B
+    return V, Y, coch.stim, Fc
+
+
+def frontend_key(run):
+    """cache key of a filterbank run"""
+    here = os.path.dirname(os.path.abspath(__file__))
+    return stage_cache.stage_key(
+        'gammatone', run, run_cochlear_model.Oversampling,
+        run_cochlear_model.sectionsNo, Order, LevelDependent,
+        CompressionSlope, list(Knee), FitLength,
+        stage_cache.file_contents(
+            os.path.join(here, 'gammatone_frontend.py'),
+            os.path.join(here, 'cochlear_model.py'),
+            os.path.join(here, 'linear_response.py'),
+            os.path.join(here, 'cochlea_utils.c')))
+
+
+def run_frontend(run, output='output.mat', writer=None):
+    """the filterbank version of run_cochlear_model.run_cochlea, with a
+    writer the output is written by its I/O thread"""
+    cache_key = frontend_key(run)
+    if stage_cache.StageCache().contains('gammatone', cache_key, [output]):
+        print("filterbank taken from cache " + cache_key)
+        # after the writes of earlier runs to the same output
+        if writer is None:
+            run_cochlear_model.fetch_run(output, 'gammatone', cache_key)
+        else:
+            writer.submit(run_cochlear_model.fetch_run, output, 'gammatone',
+                          cache_key)
+        return cache_key
+    tstart = time.time()
+    channels, samples = run['stim'].shape
+    n = run_cochlear_model.sectionsNo + 1
+    V = np.zeros([samples, n, channels])
+    Y = np.zeros([samples, n, channels])
+    E = np.zeros([samples, channels])
+    S = np.zeros([samples, channels])
+    fits = {}
+    stats = []
+    for i in range(channels):
+        t0 = time.time()
+        irr = run['irregularities'][i]
+        if irr not in fits:
+            fits[irr] = fit(run_cochlear_model.model_params(run, irr))
+        v, y, stim, Fc = solve_channel(run['stim'][i], run, i, fits[irr])
+        V[:, :, i] = v.T
+        Y[:, :, i] = y.T
+        S[:, i] = stim
+        stats.append({'channel': i, 'spl': float(run['spl'][i]),
+                      'wall_time': time.time() - t0})
+    mdict = {"Velocity": V, "Displacement": Y, "OtoAcousticEmission": E,
+             "OutStimulus": S,
+             "model_sample_rate": float(
+                 run['Fs'] * run_cochlear_model.Oversampling),
+             "Fc": Fc, "CacheKey": cache_key}
+    stats = {'stage': 'gammatone', 'cache_key': cache_key, 'cached': False,
+             'wall_time': time.time() - tstart, 'channels': stats}
+    if writer is None:
+        finish_frontend(output, mdict, cache_key, stats)
+    else:
+        writer.submit(finish_frontend, output, mdict, cache_key, stats)
+    return cache_key
+
+
+def finish_frontend(output, mdict, cache_key, stats):
+    """write a filterbank run to output, its stats sidecar and the stage
+    cache"""
+    sio.savemat(output, mdict=mdict)
+    run_cochlear_model.save_stats(output, stats)
+    stage_cache.StageCache().store('gammatone', cache_key, [output])
+
+
+if __name__ == "__main__":
+    infile = sys.argv[1] if len(sys.argv) > 1 else 'input.mat'
+    output = sys.argv[2] if len(sys.argv) > 2 else 'output.mat'
+    run_frontend(run_cochlear_model.load_input(infile), output)
@@ -0,0 +1,80 @@
+# -*- coding: utf-8 -*-
+# accuracy and cost of the imex integrator against dopri5
+#
+# usage: python integrator_report.py [poles.dat]
+#
+# Solves a 80 us click at several levels with dopri5 (the reference) and
+# with the imex integrator at several substeps per sample, and prints per
+# run the right hand side evaluations (dopri5) or tridiagonal solves (imex)
+# per sample, the run time and the relative rms error of the BM velocity
+# and of the otoacoustic emission against dopri5.
+import sys
+import time
+import numpy as np
+import cochlear_model
+import run_cochlear_model
+
+Fs = 100000.
+levels = [0, 40, 80, 100]
+substeps = [1, 2, 4, 8]
+
+
+def click(Fs):
+    stim = np.zeros(int(Fs * 15e-3))
+    stim[int(Fs * 1e-3):int(Fs * 1e-3) + int(round(80e-6 * Fs))] = \
+        2 * np.sqrt(2)
+    return stim
+
+
+def rms_error(x, ref):
+    return np.sqrt(np.mean((x - ref) ** 2)) / np.sqrt(np.mean(ref ** 2))
+
+
+def solve(run, integrator, steps):
+    coch = cochlear_model.cochlea_model()
+    coch.init_model(run['stim'][0], run['Fs'], run_cochlear_model.sectionsNo,
+                    run['probes'], sheraPo=run['sheraPo'],
+                    subject=run['subject'])
+    # count the TLsolver calls, ode looks it up at every solve
+    calls = [0]
+    tlsolver = cochlear_model.TLsolver
+
+    def counted(t, y, model):
+        calls[0] += 1
+        return tlsolver(t, y, model)
+    cochlear_model.TLsolver = counted
+    tstart = time.time()
+    try:
+        coch.solve(integrator, steps)
+    finally:
+        cochlear_model.TLsolver = tlsolver
+    elapsed = time.time() - tstart
+    samples = len(coch.stim) - 2
+    if integrator == 'imex':
+        # substeps solves plus the TLsolver call at the end of every sample
+        evals = steps + calls[0] / float(samples)
+    else:
+        evals = calls[0] / float(samples)
+    return coch, evals, elapsed
+
+
+if __name__ == "__main__":
+    poles = '../sysfiles/NHPoles/StartingPoles.dat'
+    if len(sys.argv) > 1:
+        poles = sys.argv[1]
+    sheraPo = np.loadtxt(poles, delimiter=',')
+    print("%5s %8s %6s %9s %8s %10s %10s" % (
+        'level', 'method', 'steps', 'evals/smp', 'time[s]', 'err(V)',
+        'err(OAE)'))
+    for spl in levels:
+        run = run_cochlear_model.make_run(click(Fs), Fs, [spl], 1, [1],
+                                          sheraPo, 'all')
+        ref, evals, elapsed = solve(run, 'dopri5', 1)
+        print("%5d %8s %6s %9.2f %8.2f %10s %10s" % (
+            spl, 'dopri5', '-', evals, elapsed, '-', '-'))
+        for steps in substeps:
+            coch, evals, elapsed = solve(run, 'imex', steps)
+            print("%5d %8s %6d %9.2f %8.2f %10.2e %10.2e" % (
+                spl, 'imex', steps, evals, elapsed,
+                rms_error(coch.Vsolution, ref.Vsolution),
+                rms_error(coch.oto_emission, ref.oto_emission)))
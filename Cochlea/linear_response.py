@@ -0,0 +1,122 @@
+# -*- coding: utf-8 -*-
+# linear-regime fast path of the cochlea model
+#
+# As long as no velocity (or displacement, with the displacement
+# non-linearity) crosses the knee far enough to move a pole by 1%
+# (the update threshold of TLsolver), the model never updates its poles and
+# is linear and time-invariant. Its responses to any stimulus are then the
+# convolution of the (middle ear filtered) stimulus with the impulse
+# responses of the sections, which are solved once per model snapshot and
+# stimulus length and kept in the cache (stage 'impulse').
+#
+# solve(coch, params) fills Vsolution, Ysolution and oto_emission of a
+# model initialized with its stimulus and returns True, or returns False if
+# the stimulus is loud enough to move the poles, in which case the model has
+# to be solved normally. With out, a (V, Y) pair as for cochlea_model.solve,
+# the responses are written into out.
+import os
+import numpy as np
+from scipy import signal
+import cochlear_model
+import model_snapshot
+import stage_cache
+
+# impulse of the response, in Pa, about as loud as a 10 dB SPL click
+IMPULSE = 1e-3
+# sample of the impulse, the stimulus interpolation of TLsolver spreads a
+# sample over the two samples before and after it, so the responses start
+# OFFSET samples before the impulse
+OFFSET = 2
+# fall back to the full model at this fraction of the 1% pole update
+# threshold, the linear response is only checked at the sample times
+MARGIN = 0.5
+
+
+def impulse_key(params, length, integrator, substeps):
+    here = os.path.dirname(os.path.abspath(__file__))
+    return stage_cache.stage_key(
+        'impulse', model_snapshot.model_key(params), length, integrator,
+        substeps, stage_cache.file_contents(
+            os.path.join(here, 'cochlear_model.py'),
+            os.path.join(here, 'model_snapshot.py'),
+            os.path.join(here, 'linear_response.py'),
+            os.path.join(here, 'cochlea_utils.c')))
+
+
+def impulse_response(params, length, integrator='dopri5', substeps=4,
+                     root=stage_cache.CACHE_DIR):
+    """V, Y and the emission of the sections for a unit impulse at sample
+    OFFSET, length+OFFSET samples long, from the cache if possible"""
+    key = impulse_key(params, length, integrator, substeps)
+    path = stage_cache.StageCache(root).path('impulse', key)
+    names = ['V', 'Y', 'OAE']
+    files = [os.path.join(path, f + '.npy') for f in names]
+    if not all(os.path.isfile(f) for f in files):
+        coch = model_snapshot.load_model(params, root)
+        coch.stim = np.zeros(length + OFFSET)
+        coch.stim[OFFSET] = IMPULSE
+        coch.solve(integrator, substeps)
+        if not is_linear(coch, knee_input(coch, coch.Vsolution,
+                                          coch.Ysolution)):
+            raise ValueError("the impulse response is not linear")
+        if not os.path.isdir(path):
+            try:
+                os.makedirs(path)
+            except OSError:  # made by another process in the meantime
+                pass
+        for f, x in zip(files, [coch.Vsolution, coch.Ysolution,
+                                coch.oto_emission]):
+            # write aside first, so a reader never maps a partial response
+            tmp = f + '.%d.tmp.npy' % os.getpid()
+            np.save(tmp, x / IMPULSE)
+            os.rename(tmp, f)
+    return [np.load(f, mmap_mode='r') for f in files]
+
+
+def knee_input(coch, V, Y):
+    """what drives the non-linearity of a model, V or Y"""
+    return Y if coch.non_linearity == 1 else V
+
+
+def is_linear(coch, X):
+    """True if X [section x time], the input of the non-linearity (see
+    knee_input), never moves a pole by more than MARGIN times the update
+    threshold of TLsolver"""
+    if not coch.use_Zweig:
+        return True
+    if coch.non_linearity not in (1, 2):
+        return False
+    n = coch.n + 1
+    P0 = cochlear_model.knee_poles(coch, np.zeros(n))
+    for j in range(0, X.shape[1], 1000):
+        P = cochlear_model.knee_poles(coch, X[:, j:j + 1000].T)
+        if(np.max(abs(P[:, 1:n] - P0[1:n]) / abs(P0[1:n])) >
+           MARGIN * 0.01):
+            return False
+    return True
+
+
+def solve(coch, params, integrator='dopri5', substeps=4, out=None):
+    """linear response of a model to its stimulus (coch.stim), see above"""
+    length = len(coch.stim)
+    Vir, Yir, OAEir = impulse_response(params, length, integrator, substeps)
+    stim = coch.stim[np.newaxis, :]
+    if out is None:
+        V = np.zeros([len(Vir), length])
+        Y = np.zeros([len(Yir), length])
+    else:
+        V, Y = out
+    # the last two samples are not solved by solve() either
+    V[:, length - 2:] = 0
+    Y[:, length - 2:] = 0
+    V[:, 0:length - 2] = signal.fftconvolve(
+        Vir, stim, axes=1)[:, OFFSET:OFFSET + length - 2]
+    Y[:, 0:length - 2] = signal.fftconvolve(
+        Yir, stim, axes=1)[:, OFFSET:OFFSET + length - 2]
+    if not is_linear(coch, knee_input(coch, V, Y)):
+        return False
+    coch.Vsolution = V
+    coch.Ysolution = Y
+    coch.oto_emission = signal.fftconvolve(
+        OAEir, coch.stim)[OFFSET:OFFSET + length]
+    return True
@@ -0,0 +1,49 @@
+# -*- coding: utf-8 -*-
+# sends a job to model_server.py and waits for it
+#
+# usage: python model_client.py [input.mat [output.mat]]
+#        python model_client.py --job '{"stim": "clicks.mat", ...}'
+#        python model_client.py --ping | --shutdown
+#
+# The socket is ABR_SERVER or the default of model_server.py. Only the
+# standard library is imported, so a call from MATLAB (system) starts
+# quickly. The reply is printed as JSON; the exit status is 1 if the job
+# failed.
+import json
+import os
+import socket
+import sys
+import tempfile
+
+SOCKET = os.environ.get('ABR_SERVER', os.path.join(
+    tempfile.gettempdir(), 'abr_model_server.sock'))
+
+
+def send(job, path=SOCKET):
+    """reply of the server to job"""
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(path)
+    f = sock.makefile('rw')
+    f.write(json.dumps(job) + '\n')
+    f.flush()
+    answer = json.loads(f.readline())
+    f.close()
+    sock.close()
+    return answer
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    if args[0:1] == ['--job']:
+        job = json.loads(args[1])
+    elif args[0:1] in (['--ping'], ['--shutdown']):
+        job = {'command': args[0][2:]}
+    else:
+        # the server resolves relative paths from its working directory
+        job = {'input': os.path.abspath(args[0] if args else 'input.mat'),
+               'output': os.path.abspath(args[1] if len(args) > 1
+                                         else 'output.mat')}
+    job.setdefault('id', os.getpid())
+    answer = send(job)
+    print(json.dumps(answer))
+    sys.exit(1 if 'error' in answer else 0)
@@ -0,0 +1,200 @@
+# -*- coding: utf-8 -*-
+# long running cochlea server with warm workers
+#
+# usage: python model_server.py [-j processes] [socket]
+#        python model_server.py [-j processes] -
+#
+# Every run of run_cochlear_model.py pays for the interpreter, the imports,
+# tridiag.so and the worker pool, and its workers (maxtasksperchild=1)
+# load the model snapshots again for every channel. The server starts its
+# pool once and keeps it: the workers stay alive between jobs and keep the
+# models they loaded (run_cochlear_model.WarmModels), so a small probe run
+# only costs its solve. The output files are written by an I/O thread
+# (async_writer.py) while the next job is solved.
+#
+# Jobs are JSON objects, one per line, on the Unix socket (default
+# ABR_SERVER or <tmp>/abr_model_server.sock) or with - on stdin:
+#
+# {"id": 1, "input": "input.mat", "output": "output.mat"}
+#     a run in the input.mat format of Clicks.m
+# {"id": 2, "stim": "clicks.mat", "levels": [0, 40, 80], "subject": 1,
+#  "irregularities": 1, "poles": "../sysfiles/NHPoles/StartingPoles.dat",
+#  "output": "out/clicks.mat"}
+#     a mat file with stim and Fs at the given levels (as sweep_scheduler.py),
+#     optionally with "thresholds", the knee velocities (Vthresholds.dat)
+# {"command": "ping"} or {"command": "shutdown"}
+#
+# Paths are relative to the working directory of the server. Every job is
+# answered with one JSON line once its output is written: the id, the
+# output file, its stats sidecar, the cache key and the wall time, or the
+# error. The replies come in the order of the jobs. model_client.py sends jobs
+# from the command line, e.g. from MATLAB with system().
+import json
+import multiprocessing as mp
+import os
+import socket
+import sys
+import tempfile
+import time
+import traceback
+import numpy as np
+import scipy.io as sio
+import async_writer
+import numa_placement
+import run_cochlear_model
+
+SOCKET = os.environ.get('ABR_SERVER', os.path.join(
+    tempfile.gettempdir(), 'abr_model_server.sock'))
+
+
+def make_job_run(job):
+    """run of a job, see above"""
+    if 'input' in job:
+        return run_cochlear_model.load_input(job['input'])
+    par = sio.loadmat(job['stim'])
+    stim = np.float64(par['stim'])
+    levels = np.array(job['levels'], dtype=np.float64, ndmin=1)
+    if len(stim) == 1:
+        stim = np.tile(stim, (len(levels), 1))
+    irregularities = np.array(job.get('irregularities', 1), ndmin=1)
+    if len(irregularities) == 1:
+        irregularities = np.tile(irregularities, len(levels))
+    poles = job.get('poles', '../sysfiles/StartingPoles.dat')
+    vthresholds = None
+    if 'thresholds' in job:
+        vthresholds = np.loadtxt(job['thresholds'], delimiter=',')
+    return run_cochlear_model.make_run(
+        stim, par['Fs'][0][0], levels, job.get('subject', 1), irregularities,
+        np.array(np.loadtxt(poles, delimiter=',')), vthresholds=vthresholds)
+
+
+class Server(object):
+
+    def __init__(self, processes=None):
+        # the workers are forked with WarmModels set
+        run_cochlear_model.WarmModels = True
+        self.processes = processes or max(
+            1, int(mp.cpu_count()) // run_cochlear_model.Threads)
+        self.pool = numa_placement.pool(
+            self.processes, run_cochlear_model.Threads,
+            run_cochlear_model.Placement)
+        self.writer = async_writer.AsyncWriter()
+        self.jobs = 0
+
+    def handle(self, job):
+        """reply to one job, None stops the server"""
+        command = job.get('command', 'run')
+        if command == 'shutdown':
+            return None
+        if command == 'ping':
+            return {'id': job.get('id'), 'jobs': self.jobs,
+                    'processes': self.processes}
+        tstart = time.time()
+        output = job.get('output', 'output.mat')
+        try:
+            key = run_cochlear_model.run_cochlea(
+                make_job_run(job), output, self.processes, self.pool,
+                self.writer)
+        except Exception as e:
+            traceback.print_exc()
+            return {'id': job.get('id'), 'error': repr(e)}
+        self.jobs += 1
+        return {'id': job.get('id'), 'output': os.path.abspath(output),
+                'stats': os.path.abspath(
+                    run_cochlear_model.stats_file(output)),
+                'cache_key': key, 'start': tstart}
+
+    def reply_later(self, reply, answer):
+        """reply once the writes queued before are done"""
+        def send():
+            error = self.writer.pop_error()
+            if error is not None:
+                reply({'id': answer.get('id'), 'error': repr(error)})
+                return
+            if 'start' in answer:
+                answer['wall_time'] = time.time() - answer.pop('start')
+            reply(answer)
+        self.writer.submit(send)
+
+    def serve_lines(self, lines, reply):
+        """answer the jobs of lines with reply(dict), False on shutdown"""
+        for line in lines:
+            if not line.strip():
+                continue
+            try:
+                job = json.loads(line)
+            except ValueError as e:
+                self.reply_later(reply, {'error': 'bad job: ' + repr(e)})
+                continue
+            answer = self.handle(job)
+            if answer is None:
+                self.reply_later(reply, {'id': job.get('id'),
+                                         'shutdown': True})
+                self.writer.flush()
+                return False
+            self.reply_later(reply, answer)
+        # the client may go once it has all replies
+        self.writer.flush()
+        return True
+
+    def serve_stdin(self, out):
+        """jobs from stdin, replies to out"""
+        def reply(answer):
+            out.write(json.dumps(answer) + '\n')
+            out.flush()
+        self.serve_lines(sys.stdin, reply)
+
+    def serve_socket(self, path=SOCKET):
+        if os.path.exists(path):
+            os.remove(path)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(path)
+        sock.listen(1)
+        print("model server on " + path)
+        sys.stdout.flush()
+        try:
+            running = True
+            while running:
+                conn, _ = sock.accept()
+                f = conn.makefile('rw')
+
+                def reply(answer):
+                    f.write(json.dumps(answer) + '\n')
+                    f.flush()
+                try:
+                    running = self.serve_lines(f, reply)
+                except (IOError, OSError):  # client gone
+                    pass
+                f.close()
+                conn.close()
+        finally:
+            sock.close()
+            os.remove(path)
+
+    def close(self):
+        self.writer.close()
+        self.pool.close()
+        self.pool.join()
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    processes = None
+    if args[0:1] == ['-j']:
+        processes = int(args[1]) or None
+        args = args[2:]
+    if args[0:1] == ['-']:
+        # the progress output of the solver and the workers goes to
+        # stderr, stdout only carries the replies
+        sys.stdout.flush()
+        out = os.fdopen(os.dup(1), 'w')
+        os.dup2(2, 1)
+        sys.stdout = sys.stderr
+    server = Server(processes)
+    try:
+        if args[0:1] == ['-']:
+            server.serve_stdin(out)
+        else:
+            server.serve_socket(args[0] if args else SOCKET)
+    finally:
+        server.close()
@@ -0,0 +1,113 @@
+# -*- coding: utf-8 -*-
+# precompiled cochlea models, one per subject/hearing profile
+#
+# Everything cochlea_model.init_parameters computes (impedances, tridiagonal
+# matrix, delays, the subject's roughness Rth and the non-linearity
+# constants) does not depend on the stimulus. A snapshot stores it once per
+# (poles profile, subject, compression slope, sections, sample rate, ...) as
+# a JSON header followed by the raw arrays, 64 byte aligned. Loading a
+# snapshot maps the file read-only, so all workers of a run share the same
+# pages and only allocate the buffers the solver writes to (initState).
+#
+# usage: python model_snapshot.py input.mat
+#        precompiles the snapshots run_cochlear_model needs for input.mat
+import json
+import os
+import struct
+import sys
+import numpy as np
+import cochlear_model
+import stage_cache
+
+MAGIC = b'COCHSNAP'
+ALIGN = 64
+
+
+def model_key(params):
+    """snapshot key of the init_parameters arguments and the model source"""
+    here = os.path.dirname(os.path.abspath(__file__))
+    return stage_cache.stage_key(
+        'snapshot', params,
+        stage_cache.file_contents(os.path.join(here, 'cochlear_model.py')))
+
+
+def save_snapshot(model, filename):
+    """write the parameters of an initialized (not yet solved) model"""
+    scalars = {}
+    arrays = {}
+    blobs = []
+    offset = 0
+    for name, value in sorted(vars(model).items()):
+        if isinstance(value, np.ndarray):
+            a = np.ascontiguousarray(value)
+            if a.dtype.hasobject:
+                raise ValueError("cannot snapshot object array " + name)
+            arrays[name] = [a.dtype.str, list(a.shape), offset]
+            blobs.append((offset, a))
+            offset += -(-a.nbytes // ALIGN) * ALIGN
+        elif isinstance(value, np.generic):
+            scalars[name] = value.item()
+        elif isinstance(value, (bool, int, float, str)):
+            scalars[name] = value
+    header = json.dumps({'scalars': scalars, 'arrays': arrays}).encode()
+    start = -(-(len(MAGIC) + 8 + len(header)) // ALIGN) * ALIGN
+    with open(filename, 'wb') as f:
+        f.write(MAGIC)
+        f.write(struct.pack('<Q', len(header)))
+        f.write(header)
+        for off, a in blobs:
+            f.seek(start + off)
+            f.write(a.tobytes())
+        f.truncate(start + offset)
+
+
+def load_snapshot(filename):
+    """model of a snapshot, ready for init_stimulus and solve"""
+    data = np.memmap(filename, dtype=np.uint8, mode='r')
+    if data[0:len(MAGIC)].tobytes() != MAGIC:
+        raise ValueError(filename + " is not a model snapshot")
+    hlen = struct.unpack('<Q', data[len(MAGIC):len(MAGIC) + 8].tobytes())[0]
+    header = json.loads(
+        data[len(MAGIC) + 8:len(MAGIC) + 8 + hlen].tobytes().decode())
+    start = -(-(len(MAGIC) + 8 + hlen) // ALIGN) * ALIGN
+    model = cochlear_model.cochlea_model()
+    for name, value in header['scalars'].items():
+        setattr(model, name, value)
+    for name, (dtype, shape, offset) in header['arrays'].items():
+        setattr(model, name, np.ndarray(shape, dtype, buffer=data,
+                                        offset=start + offset))
+    model.initState()
+    return model
+
+
+def snapshot_path(params, root=stage_cache.CACHE_DIR):
+    """file of the snapshot of a model, built first if it does not exist"""
+    key = model_key(params)
+    path = os.path.join(stage_cache.StageCache(root).path('snapshot', key),
+                        'model.snap')
+    if not os.path.isfile(path):
+        if not os.path.isdir(os.path.dirname(path)):
+            try:
+                os.makedirs(os.path.dirname(path))
+            except OSError:  # made by another process in the meantime
+                pass
+        model = cochlear_model.cochlea_model()
+        model.init_parameters(**params)
+        # write aside first, so a reader never maps a partial snapshot
+        tmp = path + '.%d.tmp' % os.getpid()
+        save_snapshot(model, tmp)
+        os.rename(tmp, path)
+    return path
+
+
+def load_model(params, root=stage_cache.CACHE_DIR):
+    """cochlea_model initialized with params (the init_parameters
+    arguments), taken from its snapshot"""
+    return load_snapshot(snapshot_path(params, root))
+
+
+if __name__ == "__main__":
+    import run_cochlear_model
+    run = run_cochlear_model.load_input(sys.argv[1])
+    for irr in sorted(set(run['irregularities'])):
+        print(snapshot_path(run_cochlear_model.model_params(run, irr)))
@@ -0,0 +1,96 @@
+# -*- coding: utf-8 -*-
+# placement of the worker processes on the NUMA nodes
+#
+# The policy (run_cochlear_model.Placement, $ABR_PLACEMENT) is one of
+#   'none'  the OS places the workers and moves them between the sockets
+#   'node'  every worker is pinned to the cpus of one node, the workers are
+#           dealt round-robin over the nodes
+#   'core'  every worker is pinned to its own Threads cpus of one node
+# Linux puts a page on the node of the cpu that first writes it, so a pinned
+# worker has everything it allocates and fills on its own node: the state
+# and delay buffer of its model (initState), its Vsolution and Ysolution and
+# its rows of the output slabs (solve_to_slabs). The OpenMP threads of
+# tridiag.so are started in the worker and inherit its cpus, as do the an
+# and ic commands of sweep_scheduler.py (MATLAB and the AN MEX) run by a
+# pinned worker. Only the read-only model snapshot is shared by all nodes.
+#
+# The nodes are read from /sys/devices/system/node, without it (or without
+# sched_setaffinity) all cpus are one node. benchmark.py -p times the
+# end-to-end runs under a policy.
+import multiprocessing as mp
+import os
+
+POLICIES = ['none', 'node', 'core']
+NODE_DIR = '/sys/devices/system/node'
+
+
+def parse_cpulist(text):
+    """cpus of a cpulist, e.g. '0-3,8-11'"""
+    cpus = []
+    for part in text.strip().split(','):
+        if '-' in part:
+            first, last = part.split('-')
+            cpus.extend(range(int(first), int(last) + 1))
+        elif part:
+            cpus.append(int(part))
+    return cpus
+
+
+def nodes():
+    """cpus of every NUMA node that this process may run on"""
+    allowed = set(os.sched_getaffinity(0)) if hasattr(
+        os, 'sched_getaffinity') else set(range(mp.cpu_count()))
+    found = []
+    if os.path.isdir(NODE_DIR):
+        for d in sorted(os.listdir(NODE_DIR)):
+            if not (d.startswith('node') and d[4:].isdigit()):
+                continue
+            with open(os.path.join(NODE_DIR, d, 'cpulist')) as f:
+                cpus = [c for c in parse_cpulist(f.read()) if c in allowed]
+            if cpus:
+                found.append((int(d[4:]), cpus))
+    if not found:
+        return [sorted(allowed)]
+    return [cpus for n, cpus in sorted(found)]
+
+
+def cpus(slot, policy, threads=1, topology=None):
+    """cpus of the worker in slot"""
+    topology = topology or nodes()
+    node = topology[slot % len(topology)]
+    if policy == 'node':
+        return node
+    first = (slot // len(topology)) * threads
+    return [node[(first + t) % len(node)] for t in range(threads)]
+
+
+def alive(pid):
+    try:
+        os.kill(pid, 0)
+    except OSError:
+        return False
+    return True
+
+
+def place(owners, policy, threads):
+    """pool initializer: take the first slot of a worker that is gone (a
+    pool starts a new worker only after joining the old one, so the nodes
+    stay balanced with maxtasksperchild) and pin this worker to its cpus"""
+    with owners.get_lock():
+        for slot in range(len(owners)):
+            if owners[slot] == 0 or not alive(owners[slot]):
+                owners[slot] = os.getpid()
+                break
+    os.sched_setaffinity(0, cpus(slot, policy, threads))
+
+
+def pool(processes, threads=1, policy='none', **kwargs):
+    """mp.Pool of processes workers placed by policy, the kwargs are those
+    of mp.Pool"""
+    if policy not in POLICIES:
+        raise ValueError("unknown placement " + str(policy))
+    if policy == 'none' or not hasattr(os, 'sched_setaffinity'):
+        return mp.Pool(processes, **kwargs)
+    owners = mp.Array('i', processes)
+    return mp.Pool(processes, initializer=place,
+                   initargs=(owners, policy, threads), **kwargs)
@@ -0,0 +1,248 @@
+# -*- coding: utf-8 -*-
+# fit of a poles profile to an audiogram or to a Q_ERB curve
+#
+# usage: python pole_fitting.py audiogram.txt [outdir [poles.dat]]
+#        python pole_fitting.py --qerb qerb.txt [outdir [poles.dat]]
+#
+# options: --subject N   irregularities of subject N (default 1)
+#          --fixed-knee  Vthresholds.dat at the knee of the normal model
+#
+# audiogram.txt has per line a frequency in Hz and the hearing loss in dB at
+# it, relative to the model with the normal poles (poles.dat, default
+# ../sysfiles/NHPoles/StartingPoles.dat), qerb.txt a frequency and the Q_ERB
+# of the section tuned to it. The fitted profile is written to
+# outdir/StartingPoles.dat and outdir/Vthresholds.dat (default the current
+# directory), in the format of the files in sysfiles.
+#
+# Below the knee no pole moves and the model is linear and time-invariant
+# (see linear_response.py), in the frequency domain one tridiagonal system
+# per frequency, which is solved for all candidate profiles and frequencies
+# of a pass at once. The loss at a frequency is the loss of the peak velocity
+# along the cochlea against the normal poles, the Q_ERB of a section its CF
+# over the equivalent rectangular bandwidth of its velocity. The log of the
+# poles is moved by a profile that is interpolated (in log frequency) between
+# the target frequencies and fitted by Levenberg-Marquardt on finite
+# differences, all perturbed profiles of an iteration in one pass. The poles
+# are kept within 0.037 and 0.3 (see PolesvsCFfunction.m), larger losses than
+# 0.3 gives are not reached.
+#
+# Vthresholds.dat holds the knee velocities of the sections, lowered by the
+# fitted loss at their CF so the knees stay at the sound levels of the normal
+# model. With --fixed-knee it holds the knee velocity of the model, the knees
+# then move up by the loss.
+import os
+import sys
+import time
+import numpy as np
+import cochlear_model
+
+POLE_MIN = 0.037
+POLE_MAX = 0.3
+# log pole step of the finite differences
+STEP = 0.05
+# candidates x frequencies per tridiagonal solve
+CHUNK = 1024
+# frequencies of the Q_ERB of a section, from CF/4 to 2 CF
+ERB_POINTS = 256
+ITERATIONS = 20
+# Levenberg-Marquardt dampings tried per iteration, in one pass
+DAMPING = [1e-3, 1e-2, 1e-1, 1.]
+# stop at this maximum residual, in dB of loss or in log Q_ERB
+TOLERANCE = {'audiogram': 0.5, 'qerb': 0.01}
+
+
+def rest_model(poles, subject=1, irregularities=1, samplerate=100000.):
+    """model with the poles profile at rest, its section parameters as
+    cochlea_model.solve starts with"""
+    coch = cochlear_model.cochlea_model()
+    coch.init_parameters(samplerate, len(poles) - 1, 'all', np.array(poles),
+                         Zweig_irregularities=irregularities,
+                         subject=subject)
+    coch.Vtmp = np.zeros_like(coch.x)
+    coch.Ytmp = np.zeros_like(coch.x)
+    coch.polecalculation()
+    coch.SheraParameters()
+    return coch
+
+
+def frequency_response(models, freqs, sections=()):
+    """velocity per Pa of middle ear pressure (F0 of TLsolver) of models at
+    rest with the same sections at the frequencies freqs: V at the sections
+    [model x freq x section] and the peak |V| along the cochlea
+    [model x freq]"""
+    m0 = models[0]
+    n = m0.n + 1
+    sections = np.array(sections, dtype=int)
+    omega = m0.omega[:, np.newaxis]
+    omega2 = m0.omega2[:, np.newaxis]
+    ZAL = m0.ZAL[:, np.newaxis]
+    ZAH = m0.ZAH[:, np.newaxis]
+    D = np.array([m.SheraD for m in models]).T
+    Rho = np.array([m.SheraRho for m in models]).T
+    Mu = np.array([m.SheraMu for m in models]).T
+    which = np.repeat(np.arange(len(models)), len(freqs))
+    w = np.tile(2 * np.pi * np.asarray(freqs, dtype=float), len(models))
+    V = np.zeros([len(which), len(sections)], dtype=complex)
+    peak = np.zeros(len(which))
+    for s in range(0, len(which), CHUNK):
+        k = which[s:s + CHUNK]
+        jw = 1j * w[s:s + CHUNK]
+        # stiffness and damping of the sections with the delayed feedback,
+        # g = z*Y, and the fluid pressure Q = (z - w^2)*Y
+        z = jw * omega * D[:, k] + omega2 * (
+            1 + Rho[:, k] * np.exp(-jw * Mu[:, k] / omega))
+        zw = z + jw ** 2
+        b = m0.ZASC[:, np.newaxis] * zw - m0.ZASQ[:, np.newaxis] * z
+        c = np.zeros_like(z)
+        c[0:n - 1] = ZAH[0:n - 1] * zw[1:n]
+        # middle ear, unknown Q0 with V0 from the first equation of TLsolver
+        den = jw - m0.RK4G_0 * m0.d_m_factor
+        b[0] = m0.ZASC[0] - m0.d_m_factor * m0.RK4_0 / den
+        x = np.zeros_like(z)
+        x[0] = m0.p0x * (1 + m0.d_m_factor * m0.RK4G_0 / den) / b[0]
+        c[0] = c[0] / b[0]
+        # Thomas, the right hand side is zero beyond the middle ear
+        for i in range(1, n):
+            a = ZAL[i] * zw[i - 1] if i > 1 else ZAL[i]
+            m = 1. / (b[i] - a * c[i - 1])
+            c[i] = c[i] * m
+            x[i] = -a * x[i - 1] * m
+        for i in range(n - 2, -1, -1):
+            x[i] -= c[i] * x[i + 1]
+        x[1:n] *= jw
+        V[s:s + CHUNK] = x[sections].T
+        peak[s:s + CHUNK] = np.max(abs(x[1:n]), axis=0)
+    return (V.reshape(len(models), len(freqs), len(sections)),
+            peak.reshape(len(models), len(freqs)))
+
+
+def profile(nh, logf, knots, theta):
+    """poles of the log pole shifts theta at the knots"""
+    return np.clip(nh * np.exp(np.interp(logf, knots, theta)),
+                   POLE_MIN, POLE_MAX)
+
+
+class Target(object):
+    """residuals of candidate profiles against an audiogram (loss in dB) or
+    a Q_ERB curve (in log Q_ERB)"""
+
+    def __init__(self, kind, freqs, values, nh, subject=1):
+        self.kind = kind
+        self.freqs = np.array(freqs, dtype=float)
+        self.values = np.array(values, dtype=float)
+        self.subject = subject
+        self.nh = rest_model(nh, subject)
+        cf = self.nh.f_resonance
+        self.sections = np.array(
+            [np.argmin(abs(cf[1:] - f)) + 1 for f in self.freqs])
+        if kind == 'audiogram':
+            self.grid = self.freqs
+            self.peak_nh = frequency_response([self.nh], self.grid)[1][0]
+        else:
+            self.grid = np.concatenate(
+                [cf[s] * 2 ** np.linspace(-2, 1, ERB_POINTS)
+                 for s in self.sections])
+
+    def qerb(self, models):
+        V = frequency_response(models, self.grid, self.sections)[0]
+        Q = np.zeros([len(models), len(self.sections)])
+        for k, s in enumerate(self.sections):
+            block = slice(k * ERB_POINTS, (k + 1) * ERB_POINTS)
+            P = abs(V[:, block, k]) ** 2
+            df = np.diff(self.grid[block])
+            erb = np.sum((P[:, 1:] + P[:, :-1]) * df, axis=1) / 2 / \
+                np.max(P, axis=1)
+            Q[:, k] = self.nh.f_resonance[s] / erb
+        return Q
+
+    def residuals(self, profiles):
+        models = [rest_model(p, self.subject) for p in profiles]
+        if self.kind == 'audiogram':
+            peak = frequency_response(models, self.grid)[1]
+            return 20 * np.log10(self.peak_nh / peak) - self.values
+        return np.log(self.qerb(models)) - np.log(self.values)
+
+
+def fit(target, nh, iterations=ITERATIONS, log=True):
+    """poles profile fitted to the target and its residuals"""
+    logf = np.log(np.maximum(target.nh.f_resonance, 1.))
+    knots = np.log(target.freqs)
+    K = len(knots)
+    theta = np.zeros(K)
+    tstart = time.time()
+    for it in range(iterations + 1):
+        thetas = [theta] + [theta + STEP * e for e in np.eye(K)]
+        R = target.residuals([profile(nh, logf, knots, t) for t in thetas])
+        r = R[0]
+        if log:
+            print("%4d %10.4f %8.1f" % (it, np.max(abs(r)),
+                                        time.time() - tstart))
+        if np.max(abs(r)) < TOLERANCE[target.kind] or it == iterations:
+            break
+        J = (R[1:] - r).T / STEP
+        A = np.sum(J ** 2, axis=0)
+        trials = []
+        for lam in DAMPING:
+            M = np.vstack([J, np.diag(np.sqrt(lam * A + 1e-12))])
+            step = np.linalg.lstsq(M, np.concatenate([-r, np.zeros(K)]),
+                                   rcond=None)[0]
+            trials.append(theta + step)
+        Rt = target.residuals([profile(nh, logf, knots, t) for t in trials])
+        best = np.argmin(np.sum(Rt ** 2, axis=1))
+        # stop when no damping gains 1%, e.g. against clipped poles
+        if np.sum(Rt[best] ** 2) > 0.99 * np.sum(r ** 2):
+            break
+        theta = trials[best]
+    return profile(nh, logf, knots, theta), r
+
+
+def knee_velocities(nh, poles, subject=1, fixed=False):
+    """knee velocity of the sections (Vthresholds.dat), see above"""
+    model = rest_model(poles, subject)
+    n = model.n + 1
+    if fixed:
+        return model.Vknee1 * np.ones(n - 1)
+    sections = np.arange(1, n)
+    V = frequency_response([rest_model(nh, subject), model],
+                           model.f_resonance[1:n], sections)[0]
+    loss = 20 * np.log10(abs(np.diagonal(V[0])) / abs(np.diagonal(V[1])))
+    return model.Vknee1 * 10 ** (-loss / 20.)
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    kind = 'audiogram'
+    subject = 1
+    fixed = False
+    while args[0].startswith('--'):
+        if args[0] == '--qerb':
+            kind = 'qerb'
+            args = args[1:]
+        elif args[0] == '--subject':
+            subject = int(args[1])
+            args = args[2:]
+        elif args[0] == '--fixed-knee':
+            fixed = True
+            args = args[1:]
+        else:
+            sys.exit("unknown option " + args[0])
+    data = np.loadtxt(args[0], ndmin=2)
+    data = data[np.argsort(data[:, 0])]
+    outdir = args[1] if len(args) > 1 else '.'
+    poles = '../sysfiles/NHPoles/StartingPoles.dat'
+    if len(args) > 2:
+        poles = args[2]
+    nh = np.loadtxt(poles, delimiter=',')
+    target = Target(kind, data[:, 0], data[:, 1], nh, subject)
+    print("%4s %10s %8s" % ('iter', 'max(res)', 'time[s]'))
+    fitted, r = fit(target, nh)
+    unit = 'dB' if kind == 'audiogram' else 'Q_ERB'
+    print("%10s %10s %10s" % ('freq', 'target', 'fitted'))
+    for f, v, e in zip(target.freqs, target.values, r):
+        print("%10.1f %10.2f %10.2f %s" % (
+            f, v, v + e if kind == 'audiogram' else v * np.exp(e), unit))
+    if not os.path.isdir(outdir):
+        os.makedirs(outdir)
+    np.savetxt(os.path.join(outdir, 'StartingPoles.dat'), fitted, fmt='%E')
+    np.savetxt(os.path.join(outdir, 'Vthresholds.dat'),
+               knee_velocities(nh, fitted, subject, fixed), fmt='%E')
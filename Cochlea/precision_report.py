@@ -0,0 +1,91 @@
+# -*- coding: utf-8 -*-
+# accuracy of the single precision storage against double precision
+#
+# usage: python precision_report.py [poles.dat [outdir]]
+#
+# Solves a 80 us click and a 1 kHz tone at several levels (in double
+# precision, the model always is) and prints per run the time of the solve
+# and the maximum error of V and Y stored as float32 (StorageType), relative
+# to the maximum of the double precision solution. The storage type is a cast
+# of the finished solution, so it changes neither the solve time nor the
+# otoacoustic emission.
+# With outdir, the output.mat of every mode is also written to
+# outdir/<mode>/<stimulus>.mat, for comparing the AN rates and IC waveforms
+# with CNIC_matlab/PrecisionReport.m (run ANClick on both with the same
+# seed).
+import os
+import sys
+import time
+import numpy as np
+import model_snapshot
+import run_cochlear_model
+
+Fs = 100000.
+levels = [0, 40, 80, 100]
+modes = ['float64', 'storage32']
+
+
+def click(Fs):
+    stim = np.zeros(int(Fs * 15e-3))
+    stim[int(Fs * 1e-3):int(Fs * 1e-3) + int(round(80e-6 * Fs))] = \
+        2 * np.sqrt(2)
+    return stim
+
+
+def tone(Fs, f=1000.):
+    t = np.arange(int(Fs * 30e-3)) / Fs
+    ramp = np.minimum(1, np.minimum(t, t[-1] - t) / 2.5e-3)
+    return np.sqrt(2) * np.sin(2 * np.pi * f * t) * ramp
+
+
+def max_error(x, ref):
+    return np.max(abs(x - ref)) / np.max(abs(ref))
+
+
+def solve(run):
+    coch = model_snapshot.load_model(run_cochlear_model.model_params(run, 1))
+    coch.init_stimulus(run['stim'][0])
+    tstart = time.time()
+    coch.solve(run_cochlear_model.Integrator,
+               run_cochlear_model.IMEXSubsteps)
+    return coch, time.time() - tstart
+
+
+def write_outputs(stim, sheraPo, outdir, name):
+    """output.mat of all levels of stim, one per mode"""
+    storage = run_cochlear_model.StorageType
+    try:
+        for mode in modes:
+            run_cochlear_model.StorageType = np.float64 \
+                if mode == 'float64' else np.float32
+            if not os.path.isdir(os.path.join(outdir, mode)):
+                os.makedirs(os.path.join(outdir, mode))
+            run = run_cochlear_model.make_run(
+                np.tile(stim, (len(levels), 1)), Fs, levels, 1,
+                [1] * len(levels), sheraPo, 'all')
+            run_cochlear_model.run_cochlea(
+                run, os.path.join(outdir, mode, name + '.mat'))
+    finally:
+        run_cochlear_model.StorageType = storage
+
+
+if __name__ == "__main__":
+    poles = '../sysfiles/NHPoles/StartingPoles.dat'
+    if len(sys.argv) > 1:
+        poles = sys.argv[1]
+    sheraPo = np.loadtxt(poles, delimiter=',')
+    stimuli = [('click', click(Fs)), ('tone', tone(Fs))]
+    print("%6s %5s %8s %10s %10s" % (
+        'stim', 'level', 'time[s]', 'err(V)', 'err(Y)'))
+    for name, stim in stimuli:
+        for spl in levels:
+            run = run_cochlear_model.make_run(stim, Fs, [spl], 1, [1],
+                                              sheraPo, 'all')
+            ref, elapsed = solve(run)
+            print("%6s %5d %8.2f %10.2e %10.2e" % (
+                name, spl, elapsed,
+                max_error(np.float32(ref.Vsolution), ref.Vsolution),
+                max_error(np.float32(ref.Ysolution), ref.Ysolution)))
+    if len(sys.argv) > 2:
+        for name, stim in stimuli:
+            write_outputs(stim, sheraPo, sys.argv[2], name)
@@ -1,87 +1,388 @@
 import numpy as np
 import scipy.io as sio
 import cochlear_model
+import collections
+import json
 import multiprocessing as mp
+import os
+import time
+import shutil
+import tempfile
+import stage_cache
+import model_snapshot
+import linear_response
+import numa_placement
 
 Oversampling = 1
 sectionsNo = 1000
+# sections of the solved model, e.g. 250 or 500 for fast screening runs. The
+# poles are resampled onto this grid and the results back onto the
+# sectionsNo+1 points of the canonical grid, so the output is unchanged in
+# shape and Fc
+ModelSections = sectionsNo
 p0 = float(2e-5)
+# non-linearity of the model, 'vel' (velocity) or 'disp' (displacement),
+# and the variability of its knees from section to section in dB
+NonLinearity = 'vel'
+KneeVar = 1.
+# 'dopri5' or 'imex' (cochlea_model.solve), with IMEXSubsteps steps per
+# sample
+Integrator = 'dopri5'
+IMEXSubsteps = 4
+# channels up to this level are taken from the impulse responses of the
+# model if they stay linear (see linear_response.py), None solves all
+LinearMaxSPL = 40
+# threads per cochlea (the right hand side tl_rhs, see TLsolver), the pool
+# then runs cpu_count/Threads cochleas at a time. The dopri5 stepping around
+# the right hand side stays serial, about 44% of a solve at 1000 sections
+# and 35% at 4000, so one cochlea speeds up at most 2.3x (2.9x) on any
+# number of cores. For more cores than channels only.
+Threads = 1
+# placement of the pool workers on the NUMA nodes ($ABR_PLACEMENT, 'none',
+# 'node' or 'core', see numa_placement.py)
+Placement = os.environ.get('ABR_PLACEMENT', 'none')
+# storage precision of Velocity and Displacement in the slabs and in
+# output.mat, the model always computes in double precision. np.float32
+# halves the slabs and output.mat, the rounding errors are listed by
+# precision_report.py
+StorageType = np.float64
+# silent stretches of the stimulus are skipped once the model has decayed
+# below this fraction of its peak (cochlea_model.silence), None (the
+# default) solves them. Skipping is not exact: the model restarts from rest,
+# so the residual motion is dropped, also that of the sections below
+# silence_cf (80 Hz) which are not checked, e.g. 1e-4 gives velocity errors
+# of about 2.4e-4 of the peak on sarahInput.m
+Silence = None
+# keep the models of the snapshots loaded in every process and reuse them
+# for the next run, set by model_server.py for its long lived workers. A
+# process keeps the WarmModelsMax models it used last
+WarmModels = False
+WarmModelsMax = 8
+_models = collections.OrderedDict()
+# zlib compression of output.mat, smaller files for a slower write
+Compress = False
+# directory of the checkpoints of the cochlea solves ($ABR_CHECKPOINT), each
+# channel writes its complete solver state there every CheckpointInterval
+# seconds (cochlea_model.checkpoint) and a rerun of an interrupted run
+# resumes from it, None does not checkpoint
+Checkpoint = os.environ.get('ABR_CHECKPOINT')
+CheckpointInterval = 600.
 
-# Input parameters are loaded from a mat file
-par = sio.loadmat('input.mat')
-<<<<<<< HEAD
-#par=sio.loadmat('/home/gmehraei/ABB_model/StimInput/inputclick.mat')
-=======
->>>>>>> 47cf2b327fafa10991497f50996f2b61bc7bd74e
-
-probes = np.array(par['probes'])
-probe_points = probes
-Fs = par['Fs']
-Fs = Fs[0][0]
-stim = par['stim']
-stim = np.float64(stim)  # the input is somtimes read uint8 so convert
-spl = par['spl']
-spl = np.array(spl[0])
-channels = par['channels']
-channels = channels[0][0]
-subjectNo = int(par['subject'])
-lgt = len(stim[0])
-norm_factor = p0 * 10. ** (spl / 20.)
-
-# sheraPo=0.06
-sheraPo = np.loadtxt('../sysfiles/StartingPoles.dat', delimiter=',')
-sheraPo = np.array(sheraPo)
-irr_on = np.array(par['irregularities'])
-d = len(stim[0].transpose())
-print("running cochlear simulation")
+
+def load_input(filename='input.mat', poles='../sysfiles/StartingPoles.dat',
+               thresholds=None):
+    # Input parameters are loaded from a mat file
+    par = sio.loadmat(filename)
+    #par=sio.loadmat('/home/gmehraei/ABB_model/StimInput/inputclick.mat')
+
+    probes = np.array(par['probes'])
+    Fs = par['Fs']
+    Fs = Fs[0][0]
+    stim = par['stim']
+    stim = np.float64(stim)  # the input is somtimes read uint8 so convert
+    spl = par['spl']
+    spl = np.array(spl[0])
+    subjectNo = int(par['subject'][0][0])
+    irr_on = np.array(par['irregularities'])
+    # the poles profile can be chosen in the input file, e.g.
+    # poles='../sysfiles/HIPoles/StartingPoles.dat'
+    if 'poles' in par:
+        poles = str(par['poles'][0])
+    # sheraPo=0.06
+    sheraPo = np.loadtxt(poles, delimiter=',')
+    sheraPo = np.array(sheraPo)
+    # and the knee velocities, e.g. '../sysfiles/Vthresholds.dat'
+    if 'thresholds' in par:
+        thresholds = str(par['thresholds'][0])
+    vthresholds = None
+    if thresholds is not None:
+        vthresholds = np.loadtxt(thresholds, delimiter=',')
+    return make_run(stim, Fs, spl, subjectNo, irr_on[0], sheraPo, probes,
+                    vthresholds)
+
+
+def make_run(stim, Fs, spl, subject, irregularities, sheraPo, probes='all',
+             vthresholds=None):
+    """all parameters of a run, one stimulus channel per row of stim,
+    vthresholds are the knee velocities of the sections (Vthresholds.dat),
+    None those of the model"""
+    stim = np.array(stim, dtype=np.float64, ndmin=2)
+    spl = np.array(spl, dtype=np.float64, ndmin=1)
+    norm_factor = p0 * 10. ** (spl / 20.)
+    for i in range(len(stim)):
+        # stimRms=1/(2*np.sqrt(2));
+        stimRms = 1
+        stim[i] = stim[i] / stimRms * norm_factor[i]
+    return {'stim': stim, 'Fs': Fs, 'spl': spl, 'subject': subject,
+            'irregularities': np.array(irregularities, ndmin=1),
+            'sheraPo': sheraPo, 'probes': probes,
+            'vthresholds': vthresholds}
+
+
+def resample_sections(x, sections):
+    """values along the cochlea (first axis, base to apex, e.g. a poles
+    profile or Vsolution) linearly resampled to sections+1 equally spaced
+    points"""
+    x = np.asarray(x, dtype=np.float64)
+    if x.ndim == 0 or len(x) == sections + 1:
+        return x
+    pos = np.linspace(0, len(x) - 1, sections + 1)
+    i = np.minimum(np.floor(pos).astype(int), len(x) - 2)
+    f = (pos - i).reshape((-1,) + (1,) * (x.ndim - 1))
+    return x[i] * (1 - f) + x[i + 1] * f
+
+
+def model_params(run, irregularities):
+    """init_parameters arguments of a channel, the key of its snapshot"""
+    vthresholds = run.get('vthresholds')
+    if vthresholds is not None:
+        vthresholds = np.asarray(vthresholds, dtype=np.float64)
+        # a Vthresholds.dat has no value of the middle ear, it takes that of
+        # the first section (as HIPoles/addone.m for the poles)
+        if vthresholds.ndim and len(vthresholds) == sectionsNo:
+            vthresholds = np.concatenate([vthresholds[0:1], vthresholds])
+        vthresholds = resample_sections(vthresholds, ModelSections)
+    return {'samplerate': Oversampling * run['Fs'],
+            'sections': ModelSections, 'probe_freq': run['probes'],
+            'sheraPo': resample_sections(run['sheraPo'], ModelSections),
+            'Zweig_irregularities': irregularities,
+            'non_linearity_type': NonLinearity, 'KneeVar': KneeVar,
+            'Vthresholds': vthresholds, 'subject': run['subject']}
+
+
+def load_model(params):
+    """model of a channel from its snapshot, with WarmModels the one this
+    process loaded before, reset to rest"""
+    if not WarmModels:
+        return model_snapshot.load_model(params)
+    path = model_snapshot.snapshot_path(params)
+    if path in _models:
+        model = _models.pop(path)
+        model.initState()
+    else:
+        model = model_snapshot.load_snapshot(path)
+    # most recently used last, drop the least recently used
+    _models[path] = model
+    while len(_models) > WarmModelsMax:
+        _models.popitem(last=False)
+    return model
+
+
+def is_quiet(run, i):
+    return LinearMaxSPL is not None and run['spl'][i] <= LinearMaxSPL
 
 
 #definition here, to have all the parameter implicit
-def solve_one_cochlea(model):
-    # i=model[3]
-    coch = model[0]
-    #model needs to be init here because if not pool.map crash
-    coch.init_model(model[1], Oversampling * Fs, sectionsNo, probe_points,
-                    Zweig_irregularities=model[2], sheraPo=sheraPo,
-                    subject=subjectNo)
-    coch.solve()
-    return [coch.Vsolution, coch.Ysolution, coch.oto_emission,
-            coch.stim[0:len(coch.oto_emission)], coch.f_resonance]
+def solve_one_cochlea(model, out=None):
+    # i=model[2], out as for cochlea_model.solve, only on the canonical grid
+    tstart = time.time()
+    run = model[3]
+    #model needs to be loaded here because if not pool.map crash, the
+    #snapshot is mapped read-only and shared by all workers
+    coch = load_model(model_params(run, model[1]))
+    coch.threads = Threads
+    coch.init_stimulus(model[0])
+    coch.silence = Silence
+    coch.checkpoint = None
+    if Checkpoint is not None:
+        coch.checkpoint = os.path.join(
+            Checkpoint, '%s_%d.ckpt' % (run['cache_key'], model[2]))
+        coch.checkpoint_interval = CheckpointInterval
+    linear = is_quiet(run, model[2]) and linear_response.solve(
+        coch, model_params(run, model[1]), Integrator, IMEXSubsteps, out)
+    if not linear:
+        coch.solve(Integrator, IMEXSubsteps, out=out)
+    # counters of the solver, with the channel and the wall time of all of
+    # it (snapshot, linear fast path or solve)
+    stats = dict(coch.stats, channel=int(model[2]),
+                 spl=float(run['spl'][model[2]]), linear=bool(linear),
+                 wall_time=time.time() - tstart)
+    if linear:
+        stats['peak_memory_mb'] = cochlear_model.peak_memory_mb()
+    # CFs of the canonical grid
+    x = np.linspace(0, coch.bm_length, sectionsNo + 1)
+    Fc = coch.Greenwood_A * 10 ** (-coch.Greenwood_alpha * x) - \
+        coch.Greenwood_B
+    if out is None:
+        out = (resample_sections(coch.Vsolution, sectionsNo),
+               resample_sections(coch.Ysolution, sectionsNo))
+    result = [out[0], out[1],
+              coch.oto_emission, coch.stim[0:len(coch.oto_emission)], Fc,
+              stats]
+    # a warm model does not hold on to the solution until the next run
+    coch.Vsolution = coch.Ysolution = None
+    coch.organ_of_corti_acceleration = None
+    return result
+
+
+def run_key(run):
+    """cache key of a run: all of its parameters and the model sources"""
+    here = os.path.dirname(os.path.abspath(__file__))
+    return stage_cache.stage_key(
+        'cochlea', run, Oversampling, sectionsNo, ModelSections, NonLinearity,
+        KneeVar, Integrator, IMEXSubsteps, LinearMaxSPL, Threads,
+        np.dtype(StorageType).name, Silence,
+        stage_cache.file_contents(
+            os.path.join(here, 'cochlear_model.py'),
+            os.path.join(here, 'model_snapshot.py'),
+            os.path.join(here, 'linear_response.py'),
+            os.path.join(here, 'cochlea_utils.c'),
+            os.path.join(here, 'run_cochlear_model.py')))
+
+
+def open_slabs(path, channels=None, samples=None):
+    """output slabs of a run in path, memory mapped: V and Y [channel x
+    section x sample], emission and stimulus [channel x sample]. Given the
+    sizes, the slabs are created."""
+    shapes = {'V': (channels, sectionsNo + 1, samples),
+              'Y': (channels, sectionsNo + 1, samples),
+              'E': (channels, samples), 'S': (channels, samples)}
+    dtypes = {'V': StorageType, 'Y': StorageType, 'E': np.float64,
+              'S': np.float64}
+    slabs = {}
+    for k in shapes:
+        f = os.path.join(path, k + '.npy')
+        if channels is None:
+            slabs[k] = np.load(f, mmap_mode='r+')
+        else:
+            slabs[k] = np.lib.format.open_memmap(
+                f, mode='w+', dtype=dtypes[k], shape=shapes[k])
+    return slabs
+
+
+def solve_to_slabs(model):
+    """solve_one_cochlea writing its results into the slabs in model[4],
+    only the channel, its Fc and the solver stats go back to the parent"""
+    i = model[2]
+    slabs = open_slabs(model[4])
+    # on the canonical grid the model solves straight into its rows, a
+    # resampled solution is copied
+    if ModelSections == sectionsNo:
+        result = solve_one_cochlea(model[0:4], (slabs['V'][i], slabs['Y'][i]))
+    else:
+        result = solve_one_cochlea(model[0:4])
+        slabs['V'][i] = result[0]
+        slabs['Y'][i] = result[1]
+    slabs['E'][i] = result[2]
+    slabs['S'][i] = result[3]
+    for k in slabs:
+        slabs[k].flush()
+    return i, result[4], result[5]
+
+
+def save_output(filename, slabs, Fc, run, cache_key):
+    # a channel-major slab transposed is the Fortran order savemat writes
+    sio.savemat(filename, do_compression=Compress,
+                mdict={"Velocity": slabs['V'].transpose(),
+                       "Displacement": slabs['Y'].transpose(),
+                       "OtoAcousticEmission": slabs['E'].transpose(),
+                       "OutStimulus": slabs['S'].transpose(),
+                       "model_sample_rate": float(run['Fs'] * Oversampling),
+                       "Fc": Fc, "CacheKey": cache_key})
+
+
+def stats_file(output):
+    """JSON sidecar of an output file with the stats of its run"""
+    return os.path.splitext(output)[0] + '.stats.json'
+
+
+def save_stats(output, stats):
+    with open(stats_file(output), 'w') as f:
+        json.dump(stats, f, indent=1, sort_keys=True)
+
+
+def finish_run(output, slabdir, Fc, run, cache_key, stats):
+    """write the slabs of a solved run to output, its stats sidecar and
+    the stage cache, and remove the slabs"""
+    tstart = time.time()
+    try:
+        slabs = open_slabs(slabdir)
+        save_output(output, slabs, Fc, run, cache_key)
+        del slabs
+    finally:
+        shutil.rmtree(slabdir)
+    stats['write_time'] = time.time() - tstart
+    save_stats(output, stats)
+    stage_cache.StageCache().store('cochlea', cache_key, [output])
+
+
+def fetch_run(output, stage, cache_key):
+    """copy the cached result of a run to output, with its stats sidecar"""
+    stage_cache.StageCache().fetch(stage, cache_key, [output])
+    save_stats(output, {'stage': stage, 'cache_key': cache_key,
+                        'cached': True})
 
-for i in range(channels):
-    # stimRms=1/(2*np.sqrt(2));
-    stimRms = 1
-    stim[i] = stim[i] / stimRms * norm_factor[i]
 
-sig = stim
+def run_cochlea(run, output='output.mat', processes=None, pool=None,
+                writer=None):
+    """solve all channels of a run and save them in output, processes=0
+    solves the channels one after the other in this process, a pool (of
+    model_server.py) is used instead of starting one. With a writer
+    (async_writer.AsyncWriter) the output is written by its I/O thread and
+    run_cochlea returns as soon as the channels are solved."""
+    # the cochlea stage is keyed by all parameters of the run (stimulus,
+    # levels, subject, irregularities, poles) and the model sources, so a
+    # rerun with unchanged inputs is taken from the cache
+    cache_key = run_key(run)
+    if stage_cache.StageCache().contains('cochlea', cache_key, [output]):
+        print("cochlear simulation taken from cache " + cache_key)
+        # after the writes of earlier runs to the same output
+        if writer is None:
+            fetch_run(output, 'cochlea', cache_key)
+        else:
+            writer.submit(fetch_run, output, 'cochlea', cache_key)
+        return cache_key
 
-cochlear_list = [[cochlear_model.cochlea_model(), sig[i], irr_on[0][i], i]
-                 for i in range(channels)]
+    print("running cochlear simulation")
+    tstart = time.time()
+    # build the missing snapshots once here instead of in every worker
+    for irr in set(run['irregularities']):
+        model_snapshot.snapshot_path(model_params(run, irr))
+    # and the impulse responses of the quiet channels
+    for irr in set(run['irregularities'][i] for i in range(len(run['stim']))
+                   if is_quiet(run, i)):
+        linear_response.impulse_response(
+            model_params(run, irr), run['stim'].shape[1], Integrator,
+            IMEXSubsteps)
+    # the workers write their channel into memory mapped slabs, so the
+    # results are neither pickled back nor copied again by the parent
+    channels, samples = run['stim'].shape
+    slabdir = tempfile.mkdtemp(prefix='cochlea')
+    try:
+        slabs = open_slabs(slabdir, channels, samples)
+        # every worker only needs its own row of the stimulus
+        job = dict(run)
+        job['stim'] = None
+        job['cache_key'] = cache_key
+        if Checkpoint is not None and not os.path.isdir(Checkpoint):
+            os.makedirs(Checkpoint)
+        cochlear_list = [[run['stim'][i], run['irregularities'][i], i, job,
+                          slabdir] for i in range(channels)]
+        if processes == 0:
+            done = list(map(solve_to_slabs, cochlear_list))
+        elif pool is not None:
+            done = pool.map(solve_to_slabs, cochlear_list)
+        else:
+            p = numa_placement.pool(
+                processes or max(1, int(mp.cpu_count()) // Threads), Threads,
+                Placement, maxtasksperchild=1)
+            done = p.map(solve_to_slabs, cochlear_list)
+            p.close()
+            p.join()
+        del slabs
+    except BaseException:
+        shutil.rmtree(slabdir)
+        raise
+    stats = {'stage': 'cochlea', 'cache_key': cache_key, 'cached': False,
+             'wall_time': time.time() - tstart,
+             'channels': [d[2] for d in done]}
+    if writer is None:
+        finish_run(output, slabdir, done[0][1], run, cache_key, stats)
+    else:
+        writer.submit(finish_run, output, slabdir, done[0][1], run,
+                      cache_key, stats)
+    return cache_key
 
 
 if __name__ == "__main__":
-    p = mp.Pool(int(mp.cpu_count()), maxtasksperchild=1)
-    result = p.map(solve_one_cochlea, cochlear_list)
-
-    Vresult = np.ndarray(
-        [len(result[0][0].transpose()), sectionsNo + 1, channels])
-    Yresult = np.ndarray(
-        [len(result[0][0].transpose()), sectionsNo + 1, channels])
-    Emission = np.zeros([len(result[0][0].transpose()), channels])
-    Resampled_stimulus = np.zeros([len(result[0][3].transpose()), channels])
-    Fc = result[0][4]
-    for i in range(channels):
-        Vresult[:, :, i] = result[i][0].transpose()
-        Yresult[:, :, i] = result[i][1].transpose()
-        Emission[:, i] = result[i][2]
-        Resampled_stimulus[:, i] = result[i][3]
-
-    sio.savemat('output.mat',
-                mdict={"Velocity": Vresult, "Displacement": Yresult,
-                       "OtoAcousticEmission": Emission,
-                       "OutStimulus": Resampled_stimulus,
-                       "model_sample_rate": float(Fs * Oversampling),
-                       "Fc": Fc})
-
-    p.close()
-    p.join()
+    run_cochlea(load_input('input.mat'))
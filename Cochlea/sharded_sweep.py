@@ -0,0 +1,226 @@
+# -*- coding: utf-8 -*-
+# sweeps of sweep_scheduler.py sharded over several nodes
+#
+# usage: mpirun -n 8 python sharded_sweep.py manifest.json
+#        python sharded_sweep.py --local 4 manifest.json
+#        python sharded_sweep.py --merge manifest.json
+#
+# The jobs (stimulus, profile, subject, level) of the manifest are sorted and
+# dealt round-robin over the ranks, all stages of a job on the same rank, and
+# every rank runs its shard with run_graph on the cores of its node
+# ("processes" of the manifest is per rank). The outdir (and ABR_CACHE) must
+# be on a file system shared by the nodes. The results are the files of
+# sweep_scheduler.py, every rank lists its jobs and their results in
+# <outdir>/shard_<rank>.json and these are merged into <outdir>/sweep.json:
+# by rank 0 under MPI, by the launcher with --local, or with --merge after
+# the ranks were started in some other way.
+#
+# The rank and the number of ranks are taken from ABR_RANK and ABR_SIZE, else
+# from mpi4py, else from the environment of the MPI launcher or of Slurm.
+# --local starts the ranks as processes on this machine with ABR_RANK and
+# ABR_SIZE, a stand-in for the nodes that needs no MPI. Every shard file
+# carries the id of its run (ABR_RUN, else broadcast by rank 0 under mpi4py,
+# else the Slurm job step) and its number of ranks, the merge only takes the
+# shard files of the run of the newest one, so those left by an earlier run
+# (e.g. with more ranks) are not merged in.
+#
+# A job gives the same results on any rank and for any number of ranks: the
+# cochlea is seeded by the subject, the an and ic commands can seed with
+# {seed}, a hash of the job (see job_seed).
+import glob
+import json
+import multiprocessing as mp
+import os
+import subprocess
+import sys
+import time
+import uuid
+import sweep_scheduler
+
+RANK_ENV = [('ABR_RANK', 'ABR_SIZE'),
+            ('OMPI_COMM_WORLD_RANK', 'OMPI_COMM_WORLD_SIZE'),
+            ('PMI_RANK', 'PMI_SIZE'),
+            ('SLURM_PROCID', 'SLURM_NTASKS')]
+
+
+class Transport(object):
+    """rank and number of ranks of this process, gather of the shard
+    reports on rank 0 (None on the other ranks and without MPI)"""
+
+    def __init__(self, rank=0, size=1, comm=None, run=None):
+        self.rank = rank
+        self.size = size
+        self.comm = comm
+        self.run = run
+
+    def gather(self, report):
+        if self.comm is None:
+            return None
+        return self.comm.gather(report, root=0)
+
+
+def run_id():
+    """id of the run shared by all ranks without MPI, or None"""
+    if 'ABR_RUN' in os.environ:
+        return os.environ['ABR_RUN']
+    if 'SLURM_JOB_ID' in os.environ:
+        return 'slurm-%s.%s' % (os.environ['SLURM_JOB_ID'],
+                                os.environ.get('SLURM_STEP_ID', '0'))
+    return None
+
+
+def transport():
+    if 'ABR_RANK' in os.environ:
+        return Transport(int(os.environ['ABR_RANK']),
+                         int(os.environ['ABR_SIZE']), run=run_id())
+    try:
+        from mpi4py import MPI
+        comm = MPI.COMM_WORLD
+        if comm.Get_size() > 1:
+            run = comm.bcast(run_id() or uuid.uuid4().hex, root=0)
+            return Transport(comm.Get_rank(), comm.Get_size(), comm, run)
+    except ImportError:
+        pass
+    for rank, size in RANK_ENV[1:]:
+        if rank in os.environ and size in os.environ:
+            return Transport(int(os.environ[rank]), int(os.environ[size]),
+                             run=run_id())
+    return Transport(run=run_id())
+
+
+def jobs(tasks):
+    """the jobs of a sweep in a fixed order"""
+    return sorted(set(t[1:] for t in tasks))
+
+
+def shard(tasks, rank, size):
+    """tasks of the jobs of a rank, the jobs are dealt round-robin so the
+    levels (and with them the cost) are spread evenly over the ranks"""
+    mine = set(jobs(tasks)[rank::size])
+    return dict((t, tasks[t]) for t in tasks if t[1:] in mine)
+
+
+def shard_file(outdir, rank):
+    return os.path.join(outdir, 'shard_%d.json' % rank)
+
+
+def run_shard(manifest, base, rank, size, processes=None, run=None):
+    """run the shard of a rank, returns its report"""
+    tasks = shard(sweep_scheduler.build_graph(manifest, base), rank, size)
+    outdir = os.path.normpath(os.path.join(
+        base, manifest.get('outdir', '../out/sweep')))
+    if not os.path.isdir(outdir):
+        try:
+            os.makedirs(outdir)
+        except OSError:  # made by another rank in the meantime
+            pass
+    tstart = time.time()
+    failed = set(sweep_scheduler.run_graph(
+        tasks, processes or manifest.get('processes', 0)))
+    report = {'rank': rank, 'size': size, 'run': run, 'host': os.uname()[1],
+              'wall_time': time.time() - tstart, 'jobs': []}
+    for job in jobs(tasks):
+        cochlea = tasks[('cochlea',) + job]
+        entry = {'stimulus': job[0], 'profile': job[1], 'subject': job[2],
+                 'level': job[3], 'seed': cochlea['seed'],
+                 'jobdir': cochlea['jobdir'], 'cochlea': cochlea['output'],
+                 'failed': sorted(t[0] for t in failed if t[1:] == job)}
+        report['jobs'].append(entry)
+    tmp = shard_file(outdir, rank) + '.tmp'
+    with open(tmp, 'w') as f:
+        json.dump(report, f, indent=1, sort_keys=True)
+    os.rename(tmp, shard_file(outdir, rank))
+    return report
+
+
+def merge(manifest, base, reports=None):
+    """merge the shard reports into <outdir>/sweep.json, read from the shard
+    files if not given, returns the number of failed or missing jobs"""
+    tasks = sweep_scheduler.build_graph(manifest, base)
+    outdir = os.path.normpath(os.path.join(
+        base, manifest.get('outdir', '../out/sweep')))
+    if reports is None:
+        # the shard files of the run of the newest one, a missing shard
+        # (e.g. of rank 0) does not hide the others
+        reports = []
+        for path in sorted(glob.glob(os.path.join(outdir, 'shard_*.json')),
+                           key=os.path.getmtime, reverse=True):
+            with open(path) as f:
+                report = json.load(f)
+            if not reports or ((report.get('run'), report['size']) ==
+                               (reports[0].get('run'), reports[0]['size'])):
+                reports.append(report)
+        reports.sort(key=lambda r: r['rank'])
+    size = max([r['size'] for r in reports] or [0])
+    absent = sorted(set(range(size)) - set(r['rank'] for r in reports))
+    if absent:
+        print("no report of the ranks " + ", ".join(map(str, absent)))
+    done = {}
+    for r in reports:
+        for entry in r['jobs']:
+            entry['rank'] = r['rank']
+            done[(entry['stimulus'], entry['profile'], entry['subject'],
+                  entry['level'])] = entry
+    missing = [list(j) for j in jobs(tasks) if tuple(j) not in done]
+    merged = {'run': reports[0].get('run') if reports else None,
+              'ranks': len(reports), 'absent_ranks': absent,
+              'wall_time': max([r['wall_time'] for r in reports] or [0]),
+              'jobs': [done[j] for j in sorted(done)], 'missing': missing}
+    with open(os.path.join(outdir, 'sweep.json'), 'w') as f:
+        json.dump(merged, f, indent=1, sort_keys=True)
+    bad = len(missing) + sum(1 for e in merged['jobs'] if e['failed'])
+    if bad:
+        print("%d of %d jobs failed or missing" % (bad, len(jobs(tasks))))
+    return bad
+
+
+def run_local(path, manifest, size):
+    """the ranks as processes on this machine, sharing its cores"""
+    outdir = os.path.normpath(os.path.join(
+        os.path.dirname(path), manifest.get('outdir', '../out/sweep')))
+    for f in glob.glob(os.path.join(outdir, 'shard_*.json')):
+        os.remove(f)
+    env = dict(os.environ)
+    env['ABR_SIZE'] = str(size)
+    env['ABR_RUN'] = uuid.uuid4().hex
+    processes = max(1, int(mp.cpu_count()) // size)
+    ranks = []
+    for rank in range(size):
+        env['ABR_RANK'] = str(rank)
+        ranks.append(subprocess.Popen(
+            [sys.executable, os.path.abspath(__file__), '--processes',
+             str(processes), path], env=dict(env)))
+    return [p.wait() for p in ranks]
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    local = processes = None
+    only_merge = False
+    while args[0].startswith('--'):
+        if args[0] == '--local':
+            local = int(args[1])
+            args = args[2:]
+        elif args[0] == '--processes':
+            processes = int(args[1])
+            args = args[2:]
+        elif args[0] == '--merge':
+            only_merge = True
+            args = args[1:]
+        else:
+            sys.exit("unknown option " + args[0])
+    path = os.path.abspath(args[0])
+    with open(path) as f:
+        manifest = json.load(f)
+    base = os.path.dirname(path)
+    if local:
+        run_local(path, manifest, local)
+        sys.exit(1 if merge(manifest, base) else 0)
+    if only_merge:
+        sys.exit(1 if merge(manifest, base) else 0)
+    t = transport()
+    report = run_shard(manifest, base, t.rank, t.size, processes, t.run)
+    reports = t.gather(report)
+    if reports is not None and t.rank == 0:
+        sys.exit(1 if merge(manifest, base, reports) else 0)
+    sys.exit(1 if any(e['failed'] for e in report['jobs']) else 0)
@@ -0,0 +1,104 @@
+# -*- coding: utf-8 -*-
+# content-addressed cache of the model stages
+#
+# Every stage result is stored under a key that is the SHA-1 of everything
+# the stage depends on (stimulus, poles, subject, irregularities, model
+# parameters and the model sources themselves), so unchanged stages are
+# skipped and results are shared between experiments. The layout is
+# <cache>/<stage>/<key[0:2]>/<key>/<k><ext>, the k-th result file of the
+# stage under its index (with its extension), so a result is found whatever
+# the name of the output file it is copied to. sysfiles/StageCache.m uses
+# the same layout for the MATLAB stages.
+import hashlib
+import os
+import shutil
+import numpy as np
+
+CACHE_DIR = os.environ.get('ABR_CACHE', os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), '..', 'cache'))
+
+
+def _update(h, x):
+    if isinstance(x, dict):
+        h.update(b'd')
+        for k in sorted(x):
+            _update(h, k)
+            _update(h, x[k])
+    elif isinstance(x, (list, tuple)):
+        h.update(('l%d' % len(x)).encode())
+        for item in x:
+            _update(h, item)
+    elif isinstance(x, bytes):
+        h.update(('b%d' % len(x)).encode())
+        h.update(x)
+    elif isinstance(x, str):
+        _update(h, x.encode('utf-8'))
+    elif x is None:
+        h.update(b'n')
+    else:
+        a = np.ascontiguousarray(x)
+        h.update(('a%s%s' % (a.dtype.str, a.shape)).encode())
+        h.update(a.tobytes())
+
+
+def stage_key(stage, *parts):
+    """SHA-1 key of a stage and all of its inputs (arrays, strings,
+    numbers, and lists/dicts of those)"""
+    h = hashlib.sha1()
+    _update(h, stage)
+    for part in parts:
+        _update(h, part)
+    return h.hexdigest()
+
+
+def file_contents(*paths):
+    """contents of files (e.g. a poles profile or the model sources) to be
+    hashed into a key"""
+    contents = []
+    for path in paths:
+        with open(path, 'rb') as f:
+            contents.append(f.read())
+    return contents
+
+
+class StageCache():
+
+    def __init__(self, root=CACHE_DIR):
+        self.root = root
+
+    def path(self, stage, key):
+        return os.path.join(self.root, stage, key[0:2], key)
+
+    def cached(self, stage, key, files):
+        """paths in the cache of the result files of a stage"""
+        src = self.path(stage, key)
+        return [os.path.join(src, '%d%s' % (k, os.path.splitext(f)[1]))
+                for k, f in enumerate(files)]
+
+    def contains(self, stage, key, files):
+        """True if the results of a stage for files are in the cache"""
+        return all(os.path.isfile(c) for c in self.cached(stage, key, files))
+
+    def fetch(self, stage, key, files):
+        """copy the cached results of a stage to files, returns False if the
+        stage is not in the cache"""
+        cached = self.cached(stage, key, files)
+        if not all(os.path.isfile(c) for c in cached):
+            return False
+        for c, f in zip(cached, files):
+            shutil.copyfile(c, f)
+        return True
+
+    def store(self, stage, key, files):
+        """copy the results of a stage into the cache"""
+        dst = self.path(stage, key)
+        if not os.path.isdir(dst):
+            try:
+                os.makedirs(dst)
+            except OSError:  # made by another process in the meantime
+                pass
+        for f, target in zip(files, self.cached(stage, key, files)):
+            # copy aside first, so a crash never leaves a partial result
+            tmp = target + '.%d.tmp' % os.getpid()
+            shutil.copyfile(f, tmp)
+            os.rename(tmp, target)
@@ -0,0 +1,213 @@
+# -*- coding: utf-8 -*-
+# batch scheduler for stimulus x level x subject x profile sweeps
+#
+# usage: python sweep_scheduler.py manifest.json
+#
+# The manifest (JSON, paths relative to the manifest) lists the sweep:
+#
+# {"outdir": "../out/sweep",
+#  "stimuli": {"clicks": "clicks.mat"},       # mat files with stim and Fs
+#  "levels": [0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100],
+#  "subjects": [1],
+#  "profiles": {"NH": "../sysfiles/NHPoles/StartingPoles.dat",
+#               "HI": "../sysfiles/HIPoles/StartingPoles.dat"},
+#  "thresholds": {"HI": "../sysfiles/HIPoles/Vthresholds.dat"},  # optional
+#  "irregularities": 1,
+#  "processes": 0,                            # 0: all cores
+#  "an": "matlab -batch \"cd('{root}/ANerve_matlab'); rng({seed}); ANClick('{cochlea}',1,'{jobdir}',{level})\"",
+#  "ic": "matlab -batch \"cd('{root}/CNIC_matlab'); ICClicks('TH_',[1 5],struct('L',{level},'andir','{jobdir}','outdir','{jobdir}'))\""}
+#
+# Every (stimulus, profile, subject, level) is one cochlea task, written to
+# <outdir>/<stimulus>_<profile>_S<subject>/cochlea_L<level>.mat in the
+# output.mat format. The optional an and ic commands of a level run as soon
+# as the previous stage of that level is done, so downstream stages overlap
+# with the cochleas of the other levels. Idle workers always take the ready
+# task of the most downstream stage first, and the cochlea tasks go through
+# the stage cache, so a rerun only computes what changed. {seed} in a command
+# is a seed of the job that only depends on the job itself (the cochlea is
+# seeded by the subject), see sharded_sweep.py to run a sweep on many nodes.
+import itertools
+import json
+import multiprocessing as mp
+import os
+import subprocess
+import zlib
+try:
+    import queue
+except ImportError:  # python 2
+    import Queue as queue
+import sys
+import numpy as np
+import scipy.io as sio
+import numa_placement
+import run_cochlear_model
+
+STAGES = ['cochlea', 'an', 'ic']
+# seconds between the checks of the workers of the running tasks
+LIVENESS = 10
+
+
+def job_seed(job):
+    """seed of a (stimulus, profile, subject, level) job, the same on every
+    node and for every partitioning of the sweep"""
+    name = '%s_%s_S%d_L%g' % tuple(job)
+    return zlib.crc32(name.encode('utf-8')) & 0x7fffffff
+
+
+def build_graph(manifest, base='.'):
+    """tasks of a sweep, each with the ids of the tasks it depends on"""
+    def path(p):
+        return os.path.normpath(os.path.join(base, p))
+    outdir = path(manifest.get('outdir', '../out/sweep'))
+    root = path(manifest.get('root', os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), '..')))
+    irregularities = manifest.get('irregularities', 1)
+    # knee velocities of the profiles, the model's own for the others
+    thresholds = manifest.get('thresholds', {})
+    tasks = {}
+    for (sname, pname, subject, level) in itertools.product(
+            sorted(manifest['stimuli']), sorted(manifest['profiles']),
+            manifest.get('subjects', [1]), manifest['levels']):
+        jobdir = os.path.join(outdir, '%s_%s_S%d' % (sname, pname, subject))
+        job = (sname, pname, subject, level)
+        fields = {'root': root, 'jobdir': jobdir, 'stimulus': sname,
+                  'profile': pname, 'subject': subject, 'level': level,
+                  'cochlea': os.path.join(jobdir, 'cochlea_L%g.mat' % level),
+                  'seed': job_seed(job)}
+        tasks[('cochlea',) + job] = {
+            'stage': 'cochlea', 'deps': [], 'jobdir': jobdir,
+            'output': fields['cochlea'],
+            'stimulus': path(manifest['stimuli'][sname]),
+            'poles': path(manifest['profiles'][pname]),
+            'thresholds': path(thresholds[pname]) if pname in thresholds
+            else None,
+            'subject': subject, 'level': level, 'seed': fields['seed'],
+            'irregularities': irregularities}
+        prev = ('cochlea',) + job
+        for stage in STAGES[1:]:
+            if stage in manifest:
+                tasks[(stage,) + job] = {
+                    'stage': stage, 'deps': [prev], 'jobdir': jobdir,
+                    'command': manifest[stage].format(**fields)}
+                prev = (stage,) + job
+    return tasks
+
+
+def run_task(task):
+    if not os.path.isdir(task['jobdir']):
+        try:
+            os.makedirs(task['jobdir'])
+        except OSError:  # made by another worker in the meantime
+            pass
+    if task['stage'] == 'cochlea':
+        par = sio.loadmat(task['stimulus'])
+        stim = np.float64(par['stim'])[0]
+        run = run_cochlear_model.make_run(
+            stim, par['Fs'][0][0], task['level'], task['subject'],
+            task['irregularities'],
+            np.array(np.loadtxt(task['poles'], delimiter=',')),
+            vthresholds=None if task['thresholds'] is None else
+            np.loadtxt(task['thresholds'], delimiter=','))
+        run_cochlear_model.run_cochlea(run, task['output'], processes=0)
+    else:
+        subprocess.check_call(task['command'], shell=True)
+
+
+def _run(item, started):
+    started[item[0]] = os.getpid()
+    try:
+        run_task(item[1])
+        return item[0], None
+    except BaseException as e:
+        return item[0], repr(e)
+
+
+def run_graph(tasks, processes=None):
+    """run the tasks on all cores as their dependencies finish, returns the
+    ids of the tasks that failed or were skipped because of a failure"""
+    processes = processes or int(mp.cpu_count())
+    waiting = dict((t, len(tasks[t]['deps'])) for t in tasks)
+    dependents = dict((t, []) for t in tasks)
+    for t in tasks:
+        for d in tasks[t]['deps']:
+            dependents[d].append(t)
+    # downstream stages first, so results flow through the pipeline
+    # instead of waiting for all cochleas
+    rank = dict((s, i) for i, s in enumerate(STAGES))
+
+    def priority(t):
+        return (-rank[tasks[t]['stage']], t)
+    ready = sorted([t for t in tasks if waiting[t] == 0], key=priority)
+    failed = []
+    # the cochleas are solved in the workers, the an and ic commands
+    # inherit the cpus of theirs
+    pool = numa_placement.pool(processes, run_cochlear_model.Threads,
+                               run_cochlear_model.Placement,
+                               maxtasksperchild=1)
+    done = queue.Queue()
+    # worker pid of every started task, a task whose worker is gone without
+    # a result (e.g. killed by the OOM killer) is failed instead of waited
+    # for forever
+    manager = mp.Manager()
+    started = manager.dict()
+    running = {}
+    killed = False
+    while ready or running:
+        # keep exactly one task per worker in flight, so a task that
+        # becomes ready later is not queued behind all earlier ones
+        while ready and len(running) < processes:
+            t = ready.pop(0)
+            pool.apply_async(_run, ((t, tasks[t]), started),
+                             callback=done.put,
+                             error_callback=lambda e, t=t: done.put(
+                                 (t, repr(e))))
+            running[t] = 0
+        try:
+            t, error = done.get(timeout=LIVENESS)
+        except queue.Empty:
+            for t in running:
+                pid = started.get(t)
+                if pid is not None and not numa_placement.alive(pid):
+                    running[t] += 1
+            # gone for two checks, its result is not just under way
+            lost = [t for t in running if running[t] > 1]
+            if not lost:
+                continue
+            t, error = lost[0], "worker died"
+            killed = True
+        if t not in running:  # result of a task already failed as lost
+            continue
+        del running[t]
+        if error is not None:
+            print("task %s failed: %s" % (str(t), error))
+            skipped = [t]
+            while skipped:
+                s = skipped.pop()
+                failed.append(s)
+                skipped.extend(dependents[s])
+            continue
+        print("task %s done" % str(t))
+        for d in dependents[t]:
+            waiting[d] -= 1
+            if waiting[d] == 0:
+                ready.append(d)
+        ready.sort(key=priority)
+    # the pool waits for the results of lost tasks on close
+    if killed:
+        pool.terminate()
+    else:
+        pool.close()
+    pool.join()
+    manager.shutdown()
+    return failed
+
+
+if __name__ == "__main__":
+    with open(sys.argv[1]) as f:
+        manifest = json.load(f)
+    tasks = build_graph(manifest, os.path.dirname(os.path.abspath(
+        sys.argv[1])))
+    failed = run_graph(tasks, manifest.get('processes', 0))
+    if failed:
+        print("%d of %d tasks failed" % (len(failed), len(tasks)))
+        sys.exit(1)
@@ -0,0 +1,45 @@
+function AsyncWrite(fcn,varargin)
+% AsyncWrite - bounded asynchronous write queue on a background thread
+%
+% Usage: AsyncWrite(fcn,arg1,arg2,...)
+%        AsyncWrite()
+%
+% fcn = function that writes results, e.g. @SaveResults, called as
+%       fcn(arg1,arg2,...) on a thread of the backgroundPool
+%
+% The first form queues the write and returns at once, so the next level
+% is computed while the results are written. With MaxPending writes still
+% running it first waits for the oldest. The second form waits for all
+% queued writes, call it before the results are used. An error of a write
+% is raised by the call that waits for it. Without a backgroundPool (MATLAB
+% before R2021b) the writes are done at once.
+
+MaxPending=2;
+persistent pending pool
+if isempty(pending)
+    pending={};
+    try
+        pool=backgroundPool;
+    catch
+        pool=[];
+    end
+end
+
+if nargin==0
+    while ~isempty(pending)
+        f=pending{1};
+        pending(1)=[];
+        fetchOutputs(f); %waits and rethrows the error of the write
+    end
+    return
+end
+if isempty(pool)
+    fcn(varargin{:});
+    return
+end
+while numel(pending)>=MaxPending
+    f=pending{1};
+    pending(1)=[];
+    fetchOutputs(f);
+end
+pending{end+1}=parfeval(pool,fcn,0,varargin{:});
@@ -0,0 +1,82 @@
+function result=Benchmark(outfile,baseline,repeats)
+% Benchmark - timing of the IHC, AN and CN/IC stages
+%
+% Usage: result = Benchmark(outfile,baseline,repeats)
+%
+% outfile  = JSON file for the result (optional)
+% baseline = JSON result of an earlier run to compare with (optional), from
+%            this script or from Cochlea/benchmark.py
+% repeats  = repeats of every benchmark (default 5)
+%
+% result   = struct with the machine and per benchmark the seconds per
+%            call (min and median over the repeats), in the format of
+%            Cochlea/benchmark.py
+%
+% All stages run on a 50 ms 1 kHz BM velocity at 100 kHz, with a fixed seed
+% for the noise of the synapse and the spike generator:
+%   ihc             IHCStage of one section
+%   synapse         Synapse of one HS fiber (CPU time in the AN MEX)
+%   spike_generator SpikeGenerator of one HS fiber (CPU time in the AN MEX)
+%   an_fiber        the AN MEX of one HS fiber, including the above
+%   cn_ic           ICPopulation of one synaptopathy profile over all CFs
+%   ic_scenarios    ICScenarios of the five NeuroProfile settings
+% Every benchmark slower than the baseline median by more than 10% is
+% reported as a regression.
+
+here=fileparts(mfilename('fullpath'));
+addpath(fullfile(here,'..','ANerve_matlab'),fullfile(here,'..','CNIC_matlab'))
+if nargin<3
+    repeats=5;
+end
+FS=100000;
+seed=1;
+cf=1000;
+fiberType=3;
+
+t=(0:round(50e-3*FS)-1)/FS;
+ramp=min(1,min(t,t(end)-t)/2.5e-3);
+V=41e-6*sin(2*pi*cf*t').*ramp';
+
+names={'ihc','synapse','spike_generator','an_fiber','cn_ic','ic_scenarios'};
+times=zeros(repeats,numel(names));
+load(fullfile(here,'..','CNIC_matlab','CFs.mat'),'CF')
+for r=1:repeats
+    tic; Vihc=IHCStage(V,FS); times(r,1)=toc;
+    rng(seed);
+    tic; [AN,psth,cpu]=Verhulst2014_NOFD_TH(Vihc,cf,1,1/FS,fiberType,0); times(r,4)=toc;
+    times(r,2:3)=cpu;
+    %the same AN rate at every CF
+    rate=repmat(AN(:),1,numel(CF));
+    P=NeuroProfile(CF,5);
+    opts=struct('TF',P.TF);
+    mix=[P.LS(:) P.MS(:) P.HS(:)].*ones(numel(CF),3);
+    tic; ICPopulation(rate,rate,rate,mix,opts); times(r,5)=toc;
+    for p=1:5
+        profiles(p)=NeuroProfile(CF,p);
+    end
+    tic; ICScenarios(rate,rate,rate,profiles,struct); times(r,6)=toc;
+end
+
+result.machine=struct('platform',computer,'matlab',version,'cpus',feature('numcores'));
+for k=1:numel(names)
+    result.benchmarks.(names{k})=struct('min',min(times(:,k)),'median',median(times(:,k)),'repeats',repeats,'number',1);
+    fprintf('%-18s %12.4g s\n',names{k},median(times(:,k)));
+end
+if nargin>0 && ~isempty(outfile)
+    fid=fopen(outfile,'w'); fprintf(fid,'%s',jsonencode(result)); fclose(fid);
+end
+if nargin>1 && ~isempty(baseline)
+    base=jsondecode(fileread(baseline));
+    fprintf('%-18s %12s %12s %8s\n','benchmark','median[s]','baseline[s]','ratio');
+    for k=1:numel(names)
+        if ~isfield(base.benchmarks,names{k})
+            continue
+        end
+        ratio=result.benchmarks.(names{k}).median/base.benchmarks.(names{k}).median;
+        flag='';
+        if ratio>1.1
+            flag=' REGRESSION';
+        end
+        fprintf('%-18s %12.4g %12.4g %8.2f%s\n',names{k},result.benchmarks.(names{k}).median,base.benchmarks.(names{k}).median,ratio,flag);
+    end
+end
@@ -0,0 +1,37 @@
+function SaveResults(files,data,compress,stage,key,statsfile,stats)
+% SaveResults - save the result files of a stage run, store them in the
+% stage cache and write the stats sidecar
+%
+% Usage: SaveResults(files,data,compress,stage,key,statsfile,stats)
+%
+% files     = cell array with the result files
+% data      = cell array with per file a struct, its fields are the saved
+%             variables, or a function that writes the file itself, called
+%             with the file name (e.g. SaveSpikes)
+% compress  = true saves compressed (-v7, the default of save), false
+%             uncompressed (-v6, faster to write, at most 2 GB per variable)
+% stage,key = stage and key of the results in the stage cache (see
+%             StageCache)
+% statsfile = sidecar of the stats struct (see SaveStats), write_time is
+%             set to the seconds of the writes
+%
+% The files, the cache and the sidecar are written in this order, so
+% ANClick and ICClicks can run it on a background thread (see AsyncWrite).
+
+t0=tic;
+if compress
+    fmt='-v7';
+else
+    fmt='-v6';
+end
+for k=1:numel(files)
+    s=data{k};
+    if isa(s,'function_handle')
+        s(files{k});
+    else
+        save(files{k},'-struct','s',fmt)
+    end
+end
+StageCache('put',stage,key,files);
+stats.write_time=toc(t0);
+SaveStats(statsfile,stats)
@@ -0,0 +1,13 @@
+function SaveStats(file,stats)
+% SaveStats - write the stats struct of a stage run as a JSON sidecar
+%
+% Usage: SaveStats(file,stats)
+%
+% file  = JSON file, next to the results of the stage
+% stats = struct with the counters and timings of the stage, in the layout
+%         of the sidecars of Cochlea/run_cochlear_model.py (stage,
+%         cache_key, cached, wall_time, ...)
+
+fid=fopen(file,'w');
+fprintf(fid,'%s',jsonencode(stats));
+fclose(fid);
@@ -0,0 +1,50 @@
+function hit=StageCache(action,stage,key,files)
+% StageCache - content-addressed cache of the model stage results
+%
+% Usage: hit = StageCache('get',stage,key,files)
+%        StageCache('put',stage,key,files)
+%
+% stage = name of the stage, e.g. 'an' or 'ic'
+% key   = hash of all inputs of the stage, see StageKey
+% files = cell array with the result files of the stage
+%
+% 'get' copies the cached results to files and returns true if all of them
+% are in the cache, 'put' stores the files in the cache. The cache sits in
+% ../cache (or in $ABR_CACHE) with the same layout as Cochlea/stage_cache.py,
+% the k-th file under <k-1><ext>, so intermediate results are shared between
+% experiments whatever the names of their files.
+
+root=getenv('ABR_CACHE');
+if isempty(root)
+    root=fullfile(fileparts(mfilename('fullpath')),'..','cache');
+end
+dst=fullfile(root,stage,key(1:2),key);
+
+hit=false;
+switch action
+    case 'get'
+        for k=1:numel(files)
+            if ~exist(cached(dst,files,k),'file')
+                return
+            end
+        end
+        for k=1:numel(files)
+            copyfile(cached(dst,files,k),files{k});
+        end
+        hit=true;
+    case 'put'
+        if ~exist(dst,'dir')
+            mkdir(dst);
+        end
+        for k=1:numel(files)
+            tmp=[cached(dst,files,k) '.tmp']; %never leave a partial result
+            copyfile(files{k},tmp);
+            movefile(tmp,cached(dst,files,k));
+        end
+    otherwise
+        error('StageCache: unknown action %s',action);
+end
+
+function c=cached(dst,files,k)
+[~,~,e]=fileparts(files{k});
+c=fullfile(dst,[num2str(k-1) e]);
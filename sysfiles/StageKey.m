@@ -0,0 +1,42 @@
+function key=StageKey(varargin)
+% StageKey - content hash of the inputs of a model stage
+%
+% Usage: key = StageKey(stage,input1,input2,...)
+%
+% The inputs can be numeric/logical/char arrays, cell arrays or structs of
+% those. key is the SHA-1 of all inputs (as hex string), used by StageCache.
+% The inputs are encoded differently from Cochlea/stage_cache.py, so a key
+% made here never equals one made there for the same inputs. Keys of upstream stages (the
+% CacheKey variable in their output files) are passed as plain strings, so
+% large upstream arrays never have to be hashed again.
+
+md=java.security.MessageDigest.getInstance('SHA-1');
+for i=1:numel(varargin)
+    md=hashvalue(md,varargin{i});
+end
+d=typecast(md.digest,'uint8');
+key=lower(reshape(dec2hex(d,2)',1,[]));
+
+function md=hashvalue(md,v)
+if isstruct(v)
+    f=sort(fieldnames(v));
+    for k=1:numel(v)
+        for j=1:numel(f)
+            md=hashvalue(md,f{j});
+            md=hashvalue(md,v(k).(f{j}));
+        end
+    end
+elseif iscell(v)
+    md=hashvalue(md,size(v));
+    for k=1:numel(v)
+        md=hashvalue(md,v{k});
+    end
+else
+    md.update(int8([class(v) sprintf('%d,',size(v))]));
+    if ~isempty(v)
+        if ischar(v) || islogical(v)
+            v=double(v);
+        end
+        md.update(typecast(v(:),'int8'));
+    end
+end